@@ -30,6 +30,25 @@ SOURCES += main.cpp\
     authdialog.cpp \
     proxyserver.cpp \
     proxyconnection.cpp \
+    proxyworker.cpp \
+    filesender.cpp \
+    byterange.cpp \
+    httpparser.cpp \
+    upstreampool.cpp \
+    hostcache.cpp \
+    packageindex.cpp \
+    cachewriter.cpp \
+    fetchregistry.cpp \
+    packageevictor.cpp \
+    mmapfilesender.cpp \
+    packageverifier.cpp \
+    packagepromoter.cpp \
+    downloadsegment.cpp \
+    packagewriter.cpp \
+    resumejournal.cpp \
+    downloadscheduler.cpp \
+    diskwriter.cpp \
+    bandwidthlimiter.cpp \
     configdialog.cpp
 
 HEADERS  += mainwindow.h \
@@ -43,6 +62,25 @@ HEADERS  += mainwindow.h \
     authdialog.h \
     proxyserver.h \
     proxyconnection.h \
+    proxyworker.h \
+    filesender.h \
+    byterange.h \
+    httpparser.h \
+    upstreampool.h \
+    hostcache.h \
+    packageindex.h \
+    cachewriter.h \
+    fetchregistry.h \
+    packageevictor.h \
+    mmapfilesender.h \
+    packageverifier.h \
+    packagepromoter.h \
+    downloadsegment.h \
+    packagewriter.h \
+    resumejournal.h \
+    downloadscheduler.h \
+    diskwriter.h \
+    bandwidthlimiter.h \
     configdialog.h
 
 FORMS    += mainwindow.ui downloaditem.ui \
@@ -69,6 +107,14 @@ win32 {
     QMAKE_CXXFLAGS += -mno-ms-bitfields
 }
 
+linux {
+    # zero copy transfers
+    SOURCES += sendfilesender.cpp \
+               splicetunnel.cpp
+    HEADERS += sendfilesender.h \
+               splicetunnel.h
+}
+
 macx {
     # OS X icon
     ICON = resources/images/qpsnproxy.icns
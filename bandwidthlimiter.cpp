@@ -0,0 +1,195 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bandwidthlimiter.h"
+
+#include <QCoreApplication>
+#include <QSettings>
+#include <QTime>
+
+// data allowed at once after an idle period, in milliseconds of the rate
+static const qint64 burstTime = 250;
+
+// smallest burst, so slow limits still move reasonable chunks of data
+static const qint64 minBurst = 16 * 1024;
+
+BandwidthLimiter::BandwidthLimiter(QObject *parent) :
+    QObject(parent), m_scheduled(false), m_startHour(8), m_endHour(20)
+{
+    Bucket unlimited = {0, 0, 0, 0};
+    m_total = unlimited;
+    m_buckets[Wan] = unlimited;
+    m_buckets[Lan] = unlimited;
+    m_clock.start();
+
+    // the window is set in hours, checking it every minute is enough
+    m_scheduleTimer.setInterval(60 * 1000);
+    connect(&m_scheduleTimer, SIGNAL(timeout()), this, SLOT(updateSchedule()));
+    m_scheduleTimer.start();
+
+    loadSettings();
+}
+
+BandwidthLimiter *BandwidthLimiter::instance()
+{
+    static BandwidthLimiter *limiter = new BandwidthLimiter(QCoreApplication::instance());
+    return limiter;
+}
+
+void BandwidthLimiter::loadSettings()
+{
+    QSettings settings;
+    QMutexLocker locker(&m_mutex);
+
+    // the limits are stored in KiB/s, zero means unlimited
+    m_total.limit = qMax(Q_INT64_C(0), settings.value("totalRateLimit", 0).toLongLong()) * 1024;
+    m_buckets[Wan].limit = qMax(Q_INT64_C(0), settings.value("wanRateLimit", 0).toLongLong()) * 1024;
+    m_buckets[Lan].limit = qMax(Q_INT64_C(0), settings.value("lanRateLimit", 0).toLongLong()) * 1024;
+    m_scheduled = settings.value("rateLimitSchedule", false).toBool();
+    m_startHour = qBound(0, settings.value("rateLimitStart", 8).toInt(), 23);
+    m_endHour = qBound(0, settings.value("rateLimitEnd", 20).toInt(), 23);
+
+    locker.unlock();
+    updateSchedule();
+}
+
+/**
+ * @brief BandwidthLimiter::updateSchedule
+ * Apply the limits while the current hour is inside the window, which
+ * can wrap around midnight. A window that starts and ends on the same
+ * hour covers the whole day
+ */
+void BandwidthLimiter::updateSchedule()
+{
+    QMutexLocker locker(&m_mutex);
+    bool active = true;
+
+    if(m_scheduled && m_startHour != m_endHour)
+    {
+        int hour = QTime::currentTime().hour();
+
+        if(m_startHour < m_endHour)
+            active = hour >= m_startHour && hour < m_endHour;
+        else
+            active = hour >= m_startHour || hour < m_endHour;
+    }
+
+    setRate(m_total, active ? m_total.limit : 0);
+    setRate(m_buckets[Wan], active ? m_buckets[Wan].limit : 0);
+    setRate(m_buckets[Lan], active ? m_buckets[Lan].limit : 0);
+}
+
+void BandwidthLimiter::setRate(Bucket &bucket, qint64 rate)
+{
+    if(bucket.rate == rate)
+        return;
+
+    bucket.rate = rate;
+    bucket.tokens = capacity(bucket);
+    bucket.updated = m_clock.elapsed();
+}
+
+qint64 BandwidthLimiter::capacity(const Bucket &bucket)
+{
+    return qMax(bucket.rate * burstTime / 1000, minBurst);
+}
+
+void BandwidthLimiter::refill(Bucket &bucket, qint64 now)
+{
+    bucket.tokens = qMin(bucket.tokens + double(bucket.rate) * (now - bucket.updated) / 1000, double(capacity(bucket)));
+    bucket.updated = now;
+}
+
+/**
+ * @brief BandwidthLimiter::request
+ * Take the tokens for a transfer from the bucket of the class and from
+ * the total bucket
+ * @param wanted amount of data the caller is ready to move
+ * @param retry single shot timer of the caller, started with the time
+ * left until more data can be moved when less than wanted is granted
+ * @return amount of data that can be moved now, can be zero
+ */
+qint64 BandwidthLimiter::request(Class cls, qint64 wanted, QTimer *retry)
+{
+    if(wanted <= 0)
+        return 0;
+
+    QMutexLocker locker(&m_mutex);
+    Bucket *buckets[] = {&m_buckets[cls], &m_total};
+    qint64 now = m_clock.elapsed();
+    qint64 granted = wanted;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        if(buckets[i]->rate == 0)
+            continue;
+
+        refill(*buckets[i], now);
+
+        // wait for a decent chunk instead of moving a few bytes at a time
+        qint64 tokens = qint64(buckets[i]->tokens);
+        if(tokens < qMin(wanted, capacity(*buckets[i]) / 4))
+            tokens = 0;
+
+        granted = qMin(granted, tokens);
+    }
+
+    qint64 delay = 0;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        Bucket &bucket = *buckets[i];
+
+        if(bucket.rate == 0)
+            continue;
+
+        bucket.tokens -= granted;
+
+        qint64 needed = qMin(wanted - granted, capacity(bucket) / 4);
+        if(bucket.tokens < needed)
+            delay = qMax(delay, qint64((needed - bucket.tokens) * 1000 / bucket.rate) + 1);
+    }
+
+    locker.unlock();
+
+    if(granted < wanted && retry != NULL && !retry->isActive())
+        retry->start(int(qBound(Q_INT64_C(1), delay, Q_INT64_C(1000))));
+
+    return granted;
+}
+
+/**
+ * @brief BandwidthLimiter::refund
+ * Give back the tokens of data that was granted but couldn't be moved
+ */
+void BandwidthLimiter::refund(Class cls, qint64 bytes)
+{
+    if(bytes <= 0)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    Bucket *buckets[] = {&m_buckets[cls], &m_total};
+
+    for(int i = 0; i < 2; ++i)
+    {
+        if(buckets[i]->rate > 0)
+            buckets[i]->tokens = qMin(buckets[i]->tokens + bytes, double(capacity(*buckets[i])));
+    }
+}
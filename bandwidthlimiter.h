@@ -0,0 +1,85 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BANDWIDTHLIMITER_H
+#define BANDWIDTHLIMITER_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+
+/**
+ * Token buckets shared by all the transfers of the program. The WAN
+ * bucket paces the data exchanged with the remote servers (the package
+ * downloads and both directions of the proxied connections) and the LAN
+ * bucket paces the packages served from disk to the consoles, both are
+ * children of a total bucket so the sum of both stays below its rate.
+ * The limits can be restricted to a time window of the day, outside of
+ * it the transfers run at full speed. Safe to use from any thread.
+ */
+class BandwidthLimiter : public QObject
+{
+    Q_OBJECT
+public:
+    enum Class
+    {
+        Wan,
+        Lan
+    };
+
+    static BandwidthLimiter *instance();
+
+    qint64 request(Class cls, qint64 wanted, QTimer *retry);
+    void refund(Class cls, qint64 bytes);
+
+public slots:
+    void loadSettings();
+
+private slots:
+    void updateSchedule();
+
+private:
+    explicit BandwidthLimiter(QObject *parent = 0);
+
+    struct Bucket
+    {
+        qint64 limit;
+        qint64 rate;
+        double tokens;
+        qint64 updated;
+    };
+
+    void setRate(Bucket &bucket, qint64 rate);
+    void refill(Bucket &bucket, qint64 now);
+
+    static qint64 capacity(const Bucket &bucket);
+
+    QMutex m_mutex;
+    QElapsedTimer m_clock;
+    QTimer m_scheduleTimer;
+    Bucket m_total;
+    Bucket m_buckets[2];
+    bool m_scheduled;
+    int m_startHour;
+    int m_endHour;
+};
+
+#endif // BANDWIDTHLIMITER_H
@@ -0,0 +1,329 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "byterange.h"
+
+#include <QtAlgorithms>
+
+// requests with more ranges than this are answered with the full file
+static const int maxRanges = 64;
+
+static bool rangeLessThan(const ByteRange &r1, const ByteRange &r2)
+{
+    return r1.start < r2.start;
+}
+
+QByteArray ByteRange::contentRange(qint64 size) const
+{
+    return "bytes " + QByteArray::number(start) + "-" + QByteArray::number(end) + "/" + QByteArray::number(size);
+}
+
+RangeRequest::RangeRequest() :
+    m_status(FULL)
+{
+}
+
+/**
+ * @brief RangeRequest::parse
+ * Parse the value of a Range header (RFC 7233) against a file of the given size.
+ * Syntactically invalid headers are ignored, as the RFC mandates, and the
+ * whole file is served. Overlapping or adjacent ranges are coalesced.
+ * @param header value of the Range header, without the header name
+ * @param size size of the file
+ * @return FULL, PARTIAL or NOT_SATISFIABLE
+ */
+RangeRequest::Status RangeRequest::parse(const QByteArray &header, qint64 size)
+{
+    m_status = FULL;
+    m_ranges.clear();
+
+    QByteArray value = header.trimmed();
+    int eq = value.indexOf('=');
+
+    if(header.isEmpty() || eq == -1 || value.left(eq).trimmed().toLower() != "bytes")
+        return m_status;
+
+    QList<ByteRange> ranges;
+    QList<QByteArray> specs = value.mid(eq + 1).split(',');
+    bool satisfiable = false;
+
+    if(specs.size() > maxRanges)
+        return m_status;
+
+    foreach(const QByteArray &item, specs)
+    {
+        QByteArray spec = item.trimmed();
+
+        // empty elements are allowed by the list syntax
+        if(spec.isEmpty())
+            continue;
+
+        int dash = spec.indexOf('-');
+        if(dash == -1)
+            return m_status;
+
+        QByteArray first = spec.left(dash).trimmed();
+        QByteArray last = spec.mid(dash + 1).trimmed();
+        qint64 start, end;
+
+        if(first.isEmpty())
+        {
+            // suffix range, bytes=-N are the last N bytes of the file
+            qint64 suffix;
+            if(!parsePosition(last, &suffix))
+                return m_status;
+
+            if(suffix == 0 || size == 0)
+                continue;
+
+            start = qMax(size - suffix, Q_INT64_C(0));
+            end = size - 1;
+        }
+        else
+        {
+            if(!parsePosition(first, &start))
+                return m_status;
+
+            if(last.isEmpty())
+            {
+                end = size - 1;
+            }
+            else
+            {
+                if(!parsePosition(last, &end) || end < start)
+                    return m_status;
+                end = qMin(end, size - 1);
+            }
+
+            if(start >= size)
+                continue;
+        }
+
+        satisfiable = true;
+        ranges << ByteRange(start, end);
+    }
+
+    if(!satisfiable)
+    {
+        m_status = NOT_SATISFIABLE;
+        return m_status;
+    }
+
+    qSort(ranges.begin(), ranges.end(), rangeLessThan);
+
+    foreach(const ByteRange &range, ranges)
+    {
+        if(!m_ranges.isEmpty() && range.start <= m_ranges.last().end + 1)
+            m_ranges.last().end = qMax(m_ranges.last().end, range.end);
+        else
+            m_ranges << range;
+    }
+
+    m_status = PARTIAL;
+    return m_status;
+}
+
+RangeRequest::Status RangeRequest::status() const
+{
+    return m_status;
+}
+
+const QList<ByteRange> &RangeRequest::ranges() const
+{
+    return m_ranges;
+}
+
+bool RangeRequest::parsePosition(const QByteArray &value, qint64 *position)
+{
+    if(value.isEmpty())
+        return false;
+
+    for(int i = 0; i < value.size(); i++)
+    {
+        if(value[i] < '0' || value[i] > '9')
+            return false;
+    }
+
+    bool ok;
+    *position = value.toLongLong(&ok);
+    return ok;
+}
+
+/**
+ * @brief RangeMap::RangeMap
+ * A file present from the beginning up to size
+ */
+RangeMap::RangeMap(qint64 size)
+{
+    if(size > 0)
+        m_ranges << ByteRange(0, size - 1);
+}
+
+/**
+ * @brief RangeMap::add
+ * Mark a range as present, it is merged with the overlapping and
+ * adjacent ranges
+ */
+void RangeMap::add(const ByteRange &range)
+{
+    if(range.length() <= 0)
+        return;
+
+    ByteRange merged = range;
+    int i = 0;
+
+    while(i < m_ranges.size() && m_ranges[i].end + 1 < merged.start)
+        i++;
+
+    while(i < m_ranges.size() && m_ranges[i].start <= merged.end + 1)
+    {
+        merged.start = qMin(merged.start, m_ranges[i].start);
+        merged.end = qMax(merged.end, m_ranges[i].end);
+        m_ranges.removeAt(i);
+    }
+
+    m_ranges.insert(i, merged);
+}
+
+/**
+ * @brief RangeMap::truncate
+ * Forget about the data past size
+ */
+void RangeMap::truncate(qint64 size)
+{
+    while(!m_ranges.isEmpty() && m_ranges.last().start >= size)
+        m_ranges.removeLast();
+
+    if(!m_ranges.isEmpty() && m_ranges.last().end >= size)
+        m_ranges.last().end = size - 1;
+}
+
+/**
+ * @brief RangeMap::intersect
+ * @return the data present on both maps
+ */
+RangeMap RangeMap::intersect(const RangeMap &other) const
+{
+    RangeMap result;
+    int i = 0;
+    int j = 0;
+
+    while(i < m_ranges.size() && j < other.m_ranges.size())
+    {
+        const ByteRange &a = m_ranges[i];
+        const ByteRange &b = other.m_ranges[j];
+
+        result.add(ByteRange(qMax(a.start, b.start), qMin(a.end, b.end)));
+
+        if(a.end < b.end)
+            i++;
+        else
+            j++;
+    }
+
+    return result;
+}
+
+void RangeMap::clear()
+{
+    m_ranges.clear();
+}
+
+bool RangeMap::contains(const ByteRange &range) const
+{
+    foreach(const ByteRange &present, m_ranges)
+    {
+        if(present.start <= range.start && present.end >= range.end)
+            return true;
+    }
+    return false;
+}
+
+bool RangeMap::isEmpty() const
+{
+    return m_ranges.isEmpty();
+}
+
+/**
+ * @brief RangeMap::firstMissing
+ * @return position of the first missing byte from the given position
+ */
+qint64 RangeMap::firstMissing(qint64 from) const
+{
+    foreach(const ByteRange &present, m_ranges)
+    {
+        if(present.start > from)
+            break;
+        if(present.end >= from)
+            return present.end + 1;
+    }
+    return from;
+}
+
+/**
+ * @brief RangeMap::nextPresent
+ * @return position of the first present byte from the given position,
+ * -1 if there is none
+ */
+qint64 RangeMap::nextPresent(qint64 from) const
+{
+    foreach(const ByteRange &present, m_ranges)
+    {
+        if(present.end >= from)
+            return qMax(present.start, from);
+    }
+    return -1;
+}
+
+qint64 RangeMap::presentBytes() const
+{
+    qint64 total = 0;
+    foreach(const ByteRange &present, m_ranges)
+        total += present.length();
+    return total;
+}
+
+const QList<ByteRange> &RangeMap::ranges() const
+{
+    return m_ranges;
+}
+
+QDataStream &operator<<(QDataStream &out, const RangeMap &map)
+{
+    out << qint32(map.m_ranges.size());
+    foreach(const ByteRange &range, map.m_ranges)
+        out << range.start << range.end;
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, RangeMap &map)
+{
+    qint32 count;
+    map.clear();
+    in >> count;
+
+    for(qint32 i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        ByteRange range;
+        in >> range.start >> range.end;
+        map.add(range);
+    }
+    return in;
+}
@@ -0,0 +1,96 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BYTERANGE_H
+#define BYTERANGE_H
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QList>
+
+class ByteRange
+{
+public:
+    ByteRange(qint64 first = 0, qint64 last = -1) :
+        start(first), end(last)
+        {}
+
+    qint64 length() const
+    {
+        return end - start + 1;
+    }
+
+    QByteArray contentRange(qint64 size) const;
+
+    qint64 start;
+    // inclusive, like in the HTTP headers
+    qint64 end;
+};
+
+class RangeRequest
+{
+public:
+    enum Status {FULL, PARTIAL, NOT_SATISFIABLE};
+
+    RangeRequest();
+
+    Status parse(const QByteArray &header, qint64 size);
+    Status status() const;
+    const QList<ByteRange> &ranges() const;
+
+private:
+    static bool parsePosition(const QByteArray &value, qint64 *position);
+
+    Status m_status;
+    QList<ByteRange> m_ranges;
+};
+
+/**
+ * Bytes of a file that are present on disk, as a sorted list of
+ * disjoint ranges
+ */
+class RangeMap
+{
+public:
+    RangeMap() {}
+    explicit RangeMap(qint64 size);
+
+    void add(const ByteRange &range);
+    void truncate(qint64 size);
+    RangeMap intersect(const RangeMap &other) const;
+    void clear();
+    bool contains(const ByteRange &range) const;
+    bool isEmpty() const;
+    qint64 firstMissing(qint64 from) const;
+    qint64 nextPresent(qint64 from) const;
+    qint64 presentBytes() const;
+    const QList<ByteRange> &ranges() const;
+
+private:
+    QList<ByteRange> m_ranges;
+
+    friend QDataStream &operator<<(QDataStream &out, const RangeMap &map);
+    friend QDataStream &operator>>(QDataStream &in, RangeMap &map);
+};
+
+QDataStream &operator<<(QDataStream &out, const RangeMap &map);
+QDataStream &operator>>(QDataStream &in, RangeMap &map);
+
+#endif // BYTERANGE_H
@@ -0,0 +1,169 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cachewriter.h"
+#include "diskwriter.h"
+#include "fetchregistry.h"
+#include "packageindex.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+CacheWriter::CacheWriter(const QString &name, qint64 position, bool truncate) :
+    QObject(0), m_file(PackageIndex::instance()->filePath(name)), m_journal(m_file.fileName()),
+    m_name(name), m_position(position), m_truncate(truncate), m_failed(false), m_finished(false)
+{
+}
+
+CacheWriter::~CacheWriter()
+{
+    if(m_file.isOpen())
+        m_journal.sync(&m_file);
+
+    m_file.close();
+    PackageIndex::instance()->endWrite(m_name);
+    PackageIndex::instance()->update(m_name);
+}
+
+/**
+ * @brief CacheWriter::create
+ * Start a copy of a response
+ * @param name file name of the package
+ * @param offset position of the first byte of the response on the package
+ * @param total size of the complete package
+ * @param etag validator of the response, can be empty
+ * @return a new writer or NULL if the response can't be stored
+ */
+CacheWriter *CacheWriter::create(const QString &name, qint64 offset, qint64 total, const QByteArray &etag)
+{
+    if(total <= 0 || offset >= total)
+        return NULL;
+
+    PackageIndex *index = PackageIndex::instance();
+    PackageEntry entry;
+    bool exists = index->find(name, entry);
+
+    bool corrupted = exists && entry.integrity == PackageEntry::Corrupted;
+    bool changed = exists && ((entry.expectedSize > 0 && entry.expectedSize != total) ||
+                              (!etag.isEmpty() && !entry.etag.isEmpty() && entry.etag != etag));
+
+    if(exists && entry.isComplete() && !changed && !corrupted)
+        return NULL;
+
+    // a different version of the package or a damaged file, the old data
+    // is useless
+    bool truncate = changed || corrupted;
+    if(truncate)
+    {
+        // truncating a file that is mapped by a reader would crash it
+        if(entry.writing || entry.serving)
+            return NULL;
+        index->clearRanges(name);
+    }
+
+    index->beginWrite(name);
+    index->setExpectedSize(name, total);
+
+    CacheWriter *writer = new CacheWriter(name, offset, truncate);
+    DiskWriter::instance()->attach(writer);
+    QMetaObject::invokeMethod(writer, "openFile", Qt::QueuedConnection);
+
+    qDebug() << "Storing" << name << "from offset" << offset;
+    return writer;
+}
+
+/**
+ * @brief CacheWriter::append
+ * Queue the next part of the response, called from the relay thread
+ */
+void CacheWriter::append(const QByteArray &data)
+{
+    if(data.isEmpty())
+        return;
+
+    DiskWriter::instance()->enqueue(data.size());
+    QMetaObject::invokeMethod(this, "writeData", Qt::QueuedConnection, Q_ARG(QByteArray, data));
+}
+
+/**
+ * @brief CacheWriter::finish
+ * No more data will be appended, the writer closes the file and deletes
+ * itself once the queued data is written
+ */
+void CacheWriter::finish()
+{
+    QMetaObject::invokeMethod(this, "closeFile", Qt::QueuedConnection);
+}
+
+void CacheWriter::openFile()
+{
+    // unbuffered, the data is readable by the proxy once it is in the range map
+    QIODevice::OpenMode mode = QIODevice::ReadWrite | QIODevice::Unbuffered;
+
+    if(m_truncate)
+        mode |= QIODevice::Truncate;
+
+    if(!m_file.open(mode) || !m_file.seek(m_position))
+    {
+        qWarning() << "Cannot store" << m_name << m_file.errorString();
+        m_failed = true;
+        return;
+    }
+
+    m_journal.open();
+}
+
+void CacheWriter::writeData(const QByteArray &data)
+{
+    DiskWriter *writer = DiskWriter::instance();
+    writer->dequeue(data.size());
+
+    if(m_failed || m_finished)
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if(m_file.write(data) != data.size())
+    {
+        qWarning() << "Cannot write" << m_name << m_file.errorString();
+        m_failed = true;
+        return;
+    }
+
+    writer->recordFlush(data.size(), timer.nsecsElapsed());
+    m_journal.add(m_position, data.constData(), data.size());
+
+    if(m_journal.needsSync())
+        m_journal.sync(&m_file);
+
+    PackageIndex::instance()->addRange(m_name, ByteRange(m_position, m_position + data.size() - 1));
+    FetchRegistry::instance()->notify(m_name);
+    m_position += data.size();
+}
+
+void CacheWriter::closeFile()
+{
+    if(m_finished)
+        return;
+
+    m_finished = true;
+    deleteLater();
+}
@@ -0,0 +1,64 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHEWRITER_H
+#define CACHEWRITER_H
+
+#include "resumejournal.h"
+
+#include <QFile>
+#include <QObject>
+
+/**
+ * Copy of a package response relayed by the proxy, written on the
+ * package directory by the DiskWriter thread. The data is written on its
+ * position, added to the range map of the file and recorded on its
+ * resume journal. When the disk falls
+ * behind, the relays that are storing a copy stop reading from the
+ * remote server until the queue of the disk thread drains.
+ */
+class CacheWriter : public QObject
+{
+    Q_OBJECT
+public:
+    static CacheWriter *create(const QString &name, qint64 offset, qint64 total, const QByteArray &etag);
+
+    void append(const QByteArray &data);
+    void finish();
+
+private slots:
+    void openFile();
+    void writeData(const QByteArray &data);
+    void closeFile();
+
+private:
+    explicit CacheWriter(const QString &name, qint64 position, bool truncate);
+    ~CacheWriter();
+
+    QFile m_file;
+    ResumeJournal m_journal;
+    QString m_name;
+    qint64 m_position;
+    bool m_truncate;
+    bool m_failed;
+    bool m_finished;
+};
+
+#endif // CACHEWRITER_H
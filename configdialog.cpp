@@ -1,8 +1,12 @@
 #include "configdialog.h"
 #include "ui_configdialog.h"
+#include "bandwidthlimiter.h"
 #include "downloaditem.h"
+#include "downloadscheduler.h"
+#include "packageindex.h"
 
 #include <QFileDialog>
+#include <QMessageBox>
 #include <QSettings>
 
 ConfigDialog::ConfigDialog(QWidget *parent) :
@@ -19,6 +23,15 @@ ConfigDialog::ConfigDialog(QWidget *parent) :
     int port = settings.value("proxyPort", 8888).toInt();
     ui->proxySpinBox->setValue(port);
 
+    int threads = settings.value("proxyThreads", 0).toInt();
+    ui->proxyThreadsSpinBox->setValue(threads);
+
+    int timeout = settings.value("connectTimeout", 30).toInt();
+    ui->connectTimeoutSpinBox->setValue(timeout);
+
+    int bufferSize = settings.value("proxyBufferSize", 512).toInt();
+    ui->bufferSizeSpinBox->setValue(bufferSize);
+
     int maxTitles = settings.value("maxTitles", 10240).toInt();
     ui->maxTitlesSpinBox->setValue(maxTitles);
 
@@ -31,19 +44,105 @@ ConfigDialog::ConfigDialog(QWidget *parent) :
     bool autocheck = settings.value("autoCheck", true).toBool();
     ui->downloadCheckBox->setChecked(autocheck);
 
+    bool revalidate = settings.value("revalidateCache", false).toBool();
+    ui->revalidateCheckBox->setChecked(revalidate);
+
+    bool cacheDownloads = settings.value("cacheDownloads", true).toBool();
+    ui->cacheDownloadsCheckBox->setChecked(cacheDownloads);
+
+    int cacheQuota = settings.value("cacheQuota", 0).toInt();
+    ui->cacheQuotaSpinBox->setValue(cacheQuota);
+
+    bool evictionWeighted = settings.value("evictionWeighted", false).toBool();
+    ui->evictionWeightedCheckBox->setChecked(evictionWeighted);
+
+    QString fastPath = settings.value("fastStoragePath").toString();
+    ui->fastPathEdit->setText(QDir::toNativeSeparators(fastPath));
+
+    int fastQuota = settings.value("fastStorageQuota", 64).toInt();
+    ui->fastQuotaSpinBox->setValue(fastQuota);
+
+    int promotionHits = settings.value("promotionHits", 3).toInt();
+    ui->promotionHitsSpinBox->setValue(promotionHits);
+
+    int downloadSegments = settings.value("downloadSegments", 4).toInt();
+    ui->downloadSegmentsSpinBox->setValue(downloadSegments);
+
+    int maxConnections = settings.value("maxDownloadConnections", 8).toInt();
+    ui->maxConnectionsSpinBox->setValue(maxConnections);
+
+    int maxHostConnections = settings.value("maxHostConnections", 8).toInt();
+    ui->maxHostConnectionsSpinBox->setValue(maxHostConnections);
+
+    int downloadPolicy = settings.value("downloadPolicy", 0).toInt();
+    ui->downloadPolicyComboBox->setCurrentIndex(downloadPolicy);
+
+    int totalRate = settings.value("totalRateLimit", 0).toInt();
+    ui->totalRateSpinBox->setValue(totalRate);
+
+    int wanRate = settings.value("wanRateLimit", 0).toInt();
+    ui->wanRateSpinBox->setValue(wanRate);
+
+    int lanRate = settings.value("lanRateLimit", 0).toInt();
+    ui->lanRateSpinBox->setValue(lanRate);
+
+    bool rateSchedule = settings.value("rateLimitSchedule", false).toBool();
+    ui->rateScheduleCheckBox->setChecked(rateSchedule);
+
+    int rateStart = settings.value("rateLimitStart", 8).toInt();
+    ui->rateStartSpinBox->setValue(rateStart);
+
+    int rateEnd = settings.value("rateLimitEnd", 20).toInt();
+    ui->rateEndSpinBox->setValue(rateEnd);
+
     connect(ui->pushButton, SIGNAL(clicked()), this, SLOT(openFindDialog()));
+    connect(ui->fastPathButton, SIGNAL(clicked()), this, SLOT(openFastPathDialog()));
 }
 
 void ConfigDialog::accept()
 {
+    QString downloadPath = QDir::fromNativeSeparators(ui->downloadPathEdit->text());
+    QString fastPath = QDir::fromNativeSeparators(ui->fastPathEdit->text().trimmed());
+
+    // removing a copy from the fast storage would delete the package
+    if(!fastPath.isEmpty() && PackageIndex::sharesDirectory(fastPath, downloadPath))
+    {
+        QMessageBox::warning(this, tr("Warning"), tr("The fast storage folder must be outside of the download folder"), QMessageBox::Ok);
+        return;
+    }
+
     QSettings settings;
-    settings.setValue("downloadPath", QDir::fromNativeSeparators(ui->downloadPathEdit->text()));
+    settings.setValue("downloadPath", downloadPath);
+    PackageIndex::instance()->setDirectory(DownloadItem::getPackageDir());
     settings.setValue("proxyPort", ui->proxySpinBox->value());
+    settings.setValue("proxyThreads", ui->proxyThreadsSpinBox->value());
+    settings.setValue("connectTimeout", ui->connectTimeoutSpinBox->value());
+    settings.setValue("proxyBufferSize", ui->bufferSizeSpinBox->value());
     settings.setValue("maxTitles", ui->maxTitlesSpinBox->value());
     settings.setValue("maxChecks", ui->maxChecksSpinBox->value());
     settings.setValue("autostartProxy", ui->autoStartCheckBox->isChecked());
     settings.setValue("autoCheck", ui->downloadCheckBox->isChecked());
+    settings.setValue("revalidateCache", ui->revalidateCheckBox->isChecked());
+    settings.setValue("cacheDownloads", ui->cacheDownloadsCheckBox->isChecked());
+    settings.setValue("cacheQuota", ui->cacheQuotaSpinBox->value());
+    settings.setValue("evictionWeighted", ui->evictionWeightedCheckBox->isChecked());
+    settings.setValue("fastStoragePath", fastPath);
+    settings.setValue("fastStorageQuota", ui->fastQuotaSpinBox->value());
+    settings.setValue("promotionHits", ui->promotionHitsSpinBox->value());
+    settings.setValue("downloadSegments", ui->downloadSegmentsSpinBox->value());
+    settings.setValue("maxDownloadConnections", ui->maxConnectionsSpinBox->value());
+    settings.setValue("maxHostConnections", ui->maxHostConnectionsSpinBox->value());
+    settings.setValue("downloadPolicy", ui->downloadPolicyComboBox->currentIndex());
+    settings.setValue("totalRateLimit", ui->totalRateSpinBox->value());
+    settings.setValue("wanRateLimit", ui->wanRateSpinBox->value());
+    settings.setValue("lanRateLimit", ui->lanRateSpinBox->value());
+    settings.setValue("rateLimitSchedule", ui->rateScheduleCheckBox->isChecked());
+    settings.setValue("rateLimitStart", ui->rateStartSpinBox->value());
+    settings.setValue("rateLimitEnd", ui->rateEndSpinBox->value());
     settings.sync();
+    PackageIndex::instance()->loadSettings();
+    DownloadScheduler::instance()->loadSettings();
+    BandwidthLimiter::instance()->loadSettings();
     done(Accepted);
 }
 
@@ -56,6 +155,15 @@ void ConfigDialog::openFindDialog()
         ui->downloadPathEdit->setText(QDir::toNativeSeparators((selected)));
 }
 
+void ConfigDialog::openFastPathDialog()
+{
+    QString msg = tr("Select the folder on the fast drive used to store the most requested packages");
+    QString selected = QFileDialog::getExistingDirectory(this, msg, ui->fastPathEdit->text(), QFileDialog::ShowDirsOnly);
+
+    if(!selected.isEmpty())
+        ui->fastPathEdit->setText(QDir::toNativeSeparators(selected));
+}
+
 ConfigDialog::~ConfigDialog()
 {
     delete ui;
@@ -17,6 +17,7 @@ public:
 
 private slots:
     void openFindDialog();
+    void openFastPathDialog();
     void accept();
 
 private:
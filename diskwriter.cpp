@@ -0,0 +1,192 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "diskwriter.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+
+// data queued for the disk before the readers are paused
+static const int maxQueued = 64 * 1024 * 1024;
+
+// the readers continue once the queue is down to this size
+static const int resumeQueued = maxQueued / 2;
+
+// writes slower than this are reported, in milliseconds
+static const qint64 slowFlush = 1000;
+
+// the queue and latency figures are logged this often, in milliseconds
+static const int statsInterval = 60 * 1000;
+
+DiskWriter::DiskWriter(QObject *parent) :
+    QObject(parent), m_queuedBytes(0), m_queuedWrites(0), m_blocked(0), m_flushLatency(0), m_maxFlushLatency(0), m_flushes(0)
+{
+    m_thread.setObjectName("DiskWriter");
+    m_thread.start(QThread::LowPriority);
+
+    connect(&m_statsTimer, SIGNAL(timeout()), this, SLOT(logStats()));
+    m_statsTimer.start(statsInterval);
+}
+
+DiskWriter::~DiskWriter()
+{
+    // the writes still queued are discarded, the files are left as
+    // partial downloads
+    m_thread.quit();
+    m_thread.wait();
+}
+
+/**
+ * @brief DiskWriter::instance
+ * Created on the main thread by the MainWindow and ProxyServer constructors
+ */
+DiskWriter *DiskWriter::instance()
+{
+    static DiskWriter *writer = new DiskWriter(QCoreApplication::instance());
+    return writer;
+}
+
+/**
+ * @brief DiskWriter::attach
+ * Move a writer to the disk thread, it must not have a parent. The
+ * writer is deleted if the thread stops before it finished
+ */
+void DiskWriter::attach(QObject *writer)
+{
+    writer->moveToThread(&m_thread);
+    connect(&m_thread, SIGNAL(finished()), writer, SLOT(deleteLater()));
+}
+
+/**
+ * @brief DiskWriter::enqueue
+ * Account for data posted to a writer, called from the reader thread
+ */
+void DiskWriter::enqueue(qint64 bytes)
+{
+    m_queuedBytes.fetchAndAddRelaxed(int(bytes));
+    m_queuedWrites.ref();
+}
+
+/**
+ * @brief DiskWriter::dequeue
+ * Called from the disk thread when a writer takes its data, wakes up
+ * the readers once enough of the queue is gone
+ */
+void DiskWriter::dequeue(qint64 bytes)
+{
+    int queued = m_queuedBytes.fetchAndAddRelaxed(-int(bytes)) - int(bytes);
+    m_queuedWrites.deref();
+
+    if(queued <= resumeQueued && m_blocked.testAndSetOrdered(1, 0))
+        emit drained();
+}
+
+/**
+ * @brief DiskWriter::recordFlush
+ * Keep the average and the worst latency of the writes to disk
+ * @param bytes amount of data written
+ * @param nsecs time spent on the write
+ */
+void DiskWriter::recordFlush(qint64 bytes, qint64 nsecs)
+{
+    int latency = int(qMin(nsecs / 1000, Q_INT64_C(0x7fffffff)));
+
+    // moving average, only the disk thread updates the values
+    m_flushLatency.store(m_flushLatency.load() + (latency - m_flushLatency.load()) / 8);
+
+    if(latency > m_maxFlushLatency.load())
+        m_maxFlushLatency.store(latency);
+
+    m_flushes.ref();
+
+    if(latency / 1000 >= slowFlush)
+        qWarning("Slow disk: %lld bytes written in %d ms, %d bytes queued", bytes, latency / 1000, m_queuedBytes.load());
+}
+
+/**
+ * @brief DiskWriter::isFull
+ * Called by the readers before taking more data from the network, when
+ * the queue is full they wait for drained()
+ */
+bool DiskWriter::isFull()
+{
+    if(m_queuedBytes.load() < maxQueued)
+        return false;
+
+    // set before the check again, so a dequeue running meanwhile can't
+    // miss the waiting readers
+    m_blocked.store(1);
+
+    if(m_queuedBytes.load() <= resumeQueued && m_blocked.testAndSetOrdered(1, 0))
+        return false;
+
+    return true;
+}
+
+/**
+ * @brief DiskWriter::queuedBytes
+ * @return data posted to the writers that wasn't handled yet
+ */
+qint64 DiskWriter::queuedBytes() const
+{
+    return m_queuedBytes.load();
+}
+
+/**
+ * @brief DiskWriter::queuedWrites
+ * @return number of writes posted to the writers that weren't handled yet
+ */
+int DiskWriter::queuedWrites() const
+{
+    return m_queuedWrites.load();
+}
+
+/**
+ * @brief DiskWriter::flushLatency
+ * @return moving average of the time spent on each write, in microseconds
+ */
+int DiskWriter::flushLatency() const
+{
+    return m_flushLatency.load();
+}
+
+/**
+ * @brief DiskWriter::maxFlushLatency
+ * @return longest time spent on a write, in microseconds
+ */
+int DiskWriter::maxFlushLatency() const
+{
+    return m_maxFlushLatency.load();
+}
+
+/**
+ * @brief DiskWriter::logStats
+ * Report the state of the queue, only if the disk was used since the
+ * last report
+ */
+void DiskWriter::logStats()
+{
+    int flushes = m_flushes.fetchAndStoreRelaxed(0);
+    if(flushes == 0)
+        return;
+
+    qDebug("Disk writer: %d flushes, %lld bytes in %d queued writes, %d ms average flush, %d ms worst",
+           flushes, queuedBytes(), queuedWrites(), flushLatency() / 1000, maxFlushLatency() / 1000);
+}
@@ -0,0 +1,76 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+
+/**
+ * Thread shared by all the objects that write packages to disk, the
+ * segments of the download list and the copies made by the proxy. The
+ * writers live on this thread and receive their data as queued calls,
+ * so a slow disk never blocks the GUI or the relays. The queue has an
+ * upper limit: once it is full the readers stop taking data from the
+ * network until drained() is emitted, so the remote servers slow down
+ * instead of the data piling up in memory.
+ */
+class DiskWriter : public QObject
+{
+    Q_OBJECT
+public:
+    static DiskWriter *instance();
+
+    void attach(QObject *writer);
+    void enqueue(qint64 bytes);
+    void dequeue(qint64 bytes);
+    void recordFlush(qint64 bytes, qint64 nsecs);
+    bool isFull();
+
+    qint64 queuedBytes() const;
+    int queuedWrites() const;
+    int flushLatency() const;
+    int maxFlushLatency() const;
+
+signals:
+    void drained();
+
+private slots:
+    void logStats();
+
+private:
+    explicit DiskWriter(QObject *parent = 0);
+    ~DiskWriter();
+
+    QThread m_thread;
+    QTimer m_statsTimer;
+    QAtomicInt m_queuedBytes;
+    QAtomicInt m_queuedWrites;
+    QAtomicInt m_blocked;
+    QAtomicInt m_flushLatency;
+    QAtomicInt m_maxFlushLatency;
+    // flushes done since the last report
+    QAtomicInt m_flushes;
+};
+
+#endif // DISKWRITER_H
@@ -20,13 +20,22 @@
 
 #include "downloaditem.h"
 #include "ui_downloaditem.h"
+#include "downloadscheduler.h"
+#include "downloadsegment.h"
+#include "fetchregistry.h"
+#include "packageindex.h"
+#include "packagewriter.h"
+#include "resumejournal.h"
 #include "utils.h"
 
 #include <QDebug>
 #include <QDir>
+#include <QActionGroup>
 #include <QClipboard>
+#include <QContextMenuEvent>
 #include <QFile>
 #include <QFileInfo>
+#include <QMenu>
 #include <QMessageBox>
 #include <QNetworkAccessManager>
 #include <QSettings>
@@ -34,6 +43,16 @@
 
 static const QString imageUrl("%1/%2/image?_version=00_09_000&platform=chihiro&w=124&h=124&bg_color=000000&opacity=100");
 
+// a segment is only split if both halves get at least this much data
+static const qint64 minSegmentSize = 16 * 1024 * 1024;
+
+// stored data right before a segment that is downloaded again and
+// compared, to find out if the server has another version of the package
+static const qint64 overlapSize = 64 * 1024;
+
+// segments failing in a row without any data before the download stops
+static const int maxFailures = 3;
+
 static const QString userAgent("Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/35.0.1916.114 Safari/537.36");
 
 static const QString gameTemplate("<html><head/><body>"
@@ -51,7 +70,8 @@ static const QString infoTemplate("<html><head/><body>"
 DownloadItem::DownloadItem(const TitleInfo &info, const QString &storeRoot, QWidget *parent) :
     QWidget(parent), m_info(info), m_storeRoot(storeRoot),
     m_reply(NULL), m_error(QNetworkReply::NoError),
-    m_file(NULL), m_downloading(false), m_startOffset(0),
+    m_downloading(false), m_writing(false), m_mismatch(false), m_queued(false), m_connectionLimit(0),
+    m_priority(DownloadScheduler::Normal), m_failures(0), m_startOffset(0), m_received(0),
     m_downloaded(0),
     ui(new Ui::DownloadItem)
 {
@@ -90,11 +110,16 @@ void DownloadItem::init()
     connect(ui->deleteButton, SIGNAL(clicked()), this, SLOT(deletePackage()));
 
     m_pkgname = QFileInfo(QUrl(m_info.packageUrl).path()).fileName();
-    m_pkginfo = QFileInfo(getPackageDir() + QDir::separator() + m_pkgname);
 
-    m_startOffset = m_pkginfo.exists() ? m_pkginfo.size() : 0;
+    // the file information comes from the index, no disk access here
+    PackageIndex *index = PackageIndex::instance();
+    PackageEntry entry;
+    index->setExpectedSize(m_pkgname, m_info.packageSize);
+    m_pkginfo = QFileInfo(index->filePath(m_pkgname));
+
+    m_startOffset = index->find(m_pkgname, entry) ? entry.ranges.presentBytes() : 0;
     updateDataTransferProgress(0, m_info.packageSize - m_startOffset);
-    if(m_startOffset == m_info.packageSize)
+    if(m_startOffset == m_info.packageSize && entry.integrity != PackageEntry::Corrupted)
         ui->downloadButton->setIcon(QIcon(":/main/resources/images/dialog-ok-apply.svg"));
 
     if(m_startOffset > 0)
@@ -109,6 +134,11 @@ QString DownloadItem::getPackageDir()
 
 DownloadItem::~DownloadItem()
 {
+    DownloadScheduler::instance()->remove(this);
+    FetchRegistry::instance()->cancel(this);
+
+    if(m_writing)
+        PackageIndex::instance()->endWrite(m_pkgname);
     delete ui;
 }
 
@@ -194,107 +224,427 @@ void DownloadItem::clipboardCopy()
     clipboard->setText(m_info.packageUrl);
 }
 
+/**
+ * @brief DownloadItem::downloadPackage
+ * Queue the download on the scheduler, or take it out of the queue if it
+ * was already there
+ */
 void DownloadItem::downloadPackage()
 {
-    if(!m_downloading)
+    DownloadScheduler *scheduler = DownloadScheduler::instance();
+
+    if(m_queued)
     {
-        m_downloading = true;
-        ui->downloadButton->setIcon(QIcon(":/main/resources/images/media-playback-pause.svg"));
+        m_queued = false;
+        m_connectionLimit = 0;
+        scheduler->remove(this);
+
+        if(m_downloading)
+            stopDownload();
+        else
+            finishDownload();
+        return;
     }
-    else
+
+    m_queued = true;
+    ui->downloadButton->setIcon(QIcon(":/main/resources/images/appointment-new.svg"));
+    scheduler->enqueue(this);
+}
+
+/**
+ * @brief DownloadItem::setConnectionLimit
+ * Called by the scheduler with the number of connections the download
+ * can use, zero keeps it waiting on the queue
+ */
+void DownloadItem::setConnectionLimit(int limit)
+{
+    if(!m_queued || limit == m_connectionLimit)
+        return;
+
+    m_connectionLimit = limit;
+
+    if(limit == 0)
     {
-        m_reply->abort();
+        if(m_downloading)
+            stopDownload();
         return;
     }
 
-    if(m_pkginfo.exists())
+    if(!m_downloading)
     {
-        m_startOffset = m_pkginfo.size();
+        startDownload();
+        return;
     }
-    else
+
+    // a download with a higher priority took some connections, the
+    // data of the aborted segments is requested again later
+    for(int i = m_segments.size() - 1; i >= limit; i--)
+        m_segments.at(i)->abort();
+
+    downloadNextRange();
+}
+
+/**
+ * @brief DownloadItem::remainingBytes
+ * @return data of the package that isn't stored yet
+ */
+qint64 DownloadItem::remainingBytes() const
+{
+    PackageEntry entry;
+    PackageIndex::instance()->find(m_pkgname, entry);
+    return qMax(m_info.packageSize - entry.ranges.presentBytes(), Q_INT64_C(0));
+}
+
+DownloadScheduler::Priority DownloadItem::priority() const
+{
+    return m_priority;
+}
+
+void DownloadItem::contextMenuEvent(QContextMenuEvent *event)
+{
+    QMenu menu(this);
+    QActionGroup group(&menu);
+
+    QAction *high = group.addAction(tr("High priority"));
+    QAction *normal = group.addAction(tr("Normal priority"));
+    QAction *low = group.addAction(tr("Low priority"));
+
+    high->setData(DownloadScheduler::High);
+    normal->setData(DownloadScheduler::Normal);
+    low->setData(DownloadScheduler::Low);
+
+    foreach(QAction *action, group.actions())
     {
-        QDir::root().mkpath(getPackageDir());
-        m_startOffset = 0;
+        action->setCheckable(true);
+        action->setChecked(action->data().toInt() == m_priority);
+        menu.addAction(action);
     }
 
-    updateDataTransferProgress(0, m_info.packageSize - m_startOffset);
+    QAction *selected = menu.exec(event->globalPos());
+    if(selected != NULL && selected->data().toInt() != m_priority)
+    {
+        m_priority = DownloadScheduler::Priority(selected->data().toInt());
+        DownloadScheduler::instance()->reschedule();
+    }
+}
+
+void DownloadItem::startDownload()
+{
+    QDir::root().mkpath(getPackageDir());
+
+    PackageIndex *index = PackageIndex::instance();
+    PackageEntry entry;
+    index->find(m_pkgname, entry);
+
+    // a damaged package is downloaded again from the start, the file is
+    // overwritten in place while a reader could still have it mapped
+    bool restart = entry.integrity == PackageEntry::Corrupted && !entry.writing;
+    bool truncate = restart && !entry.serving;
+    if(restart)
+        index->clearRanges(m_pkgname);
+    else if(!entry.writing && (!entry.isComplete() || QFile::exists(ResumeJournal::journalPath(m_pkginfo.absoluteFilePath()))))
+    {
+        // the index can list data that never reached the disk before a
+        // crash, only the ranges confirmed by the journal are kept. The
+        // journal of a package that looks complete means the crash came
+        // before the index was saved
+        RangeMap ranges = entry.ranges;
+        if(ResumeJournal::recover(m_pkginfo.absoluteFilePath(), &ranges))
+        {
+            qDebug() << "Dropped unconfirmed data of " << m_info.gameName;
+            index->limitRanges(m_pkgname, ranges);
+            index->find(m_pkgname, entry);
+        }
+    }
 
-    m_file = new QFile(m_pkginfo.absoluteFilePath());
+    // the segments of a preempted download could still be finishing
+    if(!m_writing)
+    {
+        index->beginWrite(m_pkgname);
+        m_writing = true;
+    }
+
+    // the file gets its final size and its disk space at once, each
+    // segment writes on its own position
+    QFile file(m_pkginfo.absoluteFilePath());
+    QIODevice::OpenMode mode = QIODevice::ReadWrite;
+    if(truncate)
+        mode |= QIODevice::Truncate;
 
-    if(!m_file->open(QIODevice::WriteOnly | QIODevice::Append))
+    if(!file.open(mode) || !PackageWriter::preallocate(&file, m_info.packageSize))
     {
-        resetDownloadState();
+        qDebug() << "Cannot open " << file.fileName() << ": " << file.errorString();
+        finishDownload();
+        return;
+    }
+    file.close();
+
+    m_downloading = true;
+    m_failures = 0;
+    m_received = 0;
+    m_startOffset = restart ? 0 : entry.ranges.presentBytes();
+    ui->downloadButton->setIcon(QIcon(":/main/resources/images/media-playback-pause.svg"));
+
+    updateDataTransferProgress(0, 0);
+    downloadNextRange();
+}
+
+/**
+ * @brief DownloadItem::stopDownload
+ * Pause the download, the data already written is kept
+ */
+void DownloadItem::stopDownload()
+{
+    m_downloading = false;
+
+    // the segments report their end to segmentFinished
+    foreach(DownloadSegment *segment, m_segments)
+        segment->abort();
+
+    if(m_segments.isEmpty())
+        finishDownload();
+}
+
+/**
+ * @brief DownloadItem::downloadNextRange
+ * Start a segment for each missing range of the package, up to the
+ * configured number of connections. The ranges that the proxy is already
+ * downloading are skipped, this is called again once their data is on
+ * disk. With no missing range left, the slowest segments are split so
+ * all the connections are kept busy.
+ */
+void DownloadItem::downloadNextRange()
+{
+    if(!m_downloading)
         return;
+
+    PackageIndex *index = PackageIndex::instance();
+    PackageEntry entry;
+    index->find(m_pkgname, entry);
+
+    // data stored or on its way through this download
+    RangeMap covered = entry.ranges;
+    foreach(DownloadSegment *segment, m_segments)
+    {
+        if(segment->remaining() > 0)
+            covered.add(ByteRange(segment->position(), segment->end() - 1));
+    }
+
+    qint64 from = 0;
+    bool waiting = false;
+
+    while(m_segments.size() < m_connectionLimit)
+    {
+        qint64 start = covered.firstMissing(from);
+        if(start >= m_info.packageSize)
+            break;
+
+        qint64 next = covered.nextPresent(start);
+        if(next == -1 || next > m_info.packageSize)
+            next = m_info.packageSize;
+
+        DownloadSegment *segment = new DownloadSegment(m_pkgname, m_pkginfo.absoluteFilePath(), start, this);
+        qint64 end = FetchRegistry::instance()->claim(m_pkgname, start, next, this, "downloadNextRange", segment);
+
+        if(end == -1)
+        {
+            qDebug() << "Waiting for the proxy to download " << m_pkgname << ", " << start;
+            delete segment;
+            waiting = true;
+            from = next;
+            continue;
+        }
+
+        if(!startSegment(segment, end))
+            return;
+
+        covered.add(ByteRange(start, end - 1));
+        from = end;
     }
 
-    qDebug() << "Downloading " << m_info.gameName << ", " << m_startOffset << "-" << m_info.packageSize;
+    while(m_segments.size() < m_connectionLimit)
+    {
+        DownloadSegment *slowest = NULL;
+
+        foreach(DownloadSegment *segment, m_segments)
+        {
+            if(segment->remaining() >= 2 * minSegmentSize && (slowest == NULL || segment->timeLeft() > slowest->timeLeft()))
+                slowest = segment;
+        }
+
+        if(slowest == NULL)
+            break;
+
+        qint64 end = slowest->end();
+        qint64 middle = slowest->split(minSegmentSize);
 
+        DownloadSegment *segment = new DownloadSegment(m_pkgname, m_pkginfo.absoluteFilePath(), middle, this);
+        FetchRegistry::instance()->add(m_pkgname, middle, end, segment);
+
+        if(!startSegment(segment, end))
+            return;
+    }
+
+    if(m_segments.isEmpty() && !waiting)
+        finishDownload();
+}
+
+/**
+ * @brief DownloadItem::startSegment
+ * @return false if the download was stopped
+ */
+bool DownloadItem::startSegment(DownloadSegment *segment, qint64 end)
+{
     QNetworkRequest request(m_info.packageUrl);
     request.setHeader(QNetworkRequest::UserAgentHeader, userAgent);
-    QByteArray rangeHeaderValue = "bytes=" + QByteArray::number(m_startOffset) + "-";
-    request.setRawHeader("Range", rangeHeaderValue);
-    m_reply = m_manager->get(request);
 
-    connect(m_reply, SIGNAL(error(QNetworkReply::NetworkError)), this, SLOT(readError(QNetworkReply::NetworkError)));
-    connect(m_reply, SIGNAL(downloadProgress(qint64,qint64)), this, SLOT(updateDataTransferProgress(qint64,qint64)));
-    connect(m_reply, SIGNAL(readyRead()), this, SLOT(savePkgPart()));
-    connect(m_reply, SIGNAL(finished()), this, SLOT(packageComplete()));
-    connect(m_reply, SIGNAL(finished()), m_reply, SLOT(deleteLater()));
+    // the data before the segment is checked only if it is on disk
+    PackageEntry entry;
+    qint64 start = segment->position();
+    qint64 overlap = qMin(overlapSize, start);
+    if(overlap > 0 && !(PackageIndex::instance()->find(m_pkgname, entry) && entry.ranges.contains(ByteRange(start - overlap, start - 1))))
+        overlap = 0;
+
+    if(!segment->start(m_manager, request, end, overlap))
+    {
+        delete segment;
+        stopDownload();
+        return false;
+    }
+
+    qDebug() << "Downloading " << m_info.gameName << ", " << segment->position() << "-" << end;
+
+    // queued, the segments can finish while they are being aborted
+    connect(segment, SIGNAL(progress(qint64)), this, SLOT(segmentProgress(qint64)));
+    connect(segment, SIGNAL(finished()), this, SLOT(segmentFinished()), Qt::QueuedConnection);
+    m_segments << segment;
+    return true;
+}
+
+void DownloadItem::segmentProgress(qint64 bytes)
+{
+    m_received += bytes;
+    updateDataTransferProgress(m_received, 0);
+}
+
+void DownloadItem::segmentFinished()
+{
+    DownloadSegment *segment = qobject_cast<DownloadSegment *>(sender());
+
+    if(segment == NULL || !m_segments.removeOne(segment))
+        return;
+
+    FetchRegistry::instance()->release(m_pkgname, segment);
+
+    // the missing data of a failed segment is requested again, unless
+    // the server keeps failing
+    if(segment->isMismatch())
+    {
+        // the stored data belongs to another version of the package, it
+        // is downloaded again once all the segments are done
+        if(m_downloading)
+        {
+            qDebug() << "The package of " << m_info.gameName << " changed on the server";
+            m_mismatch = true;
+            m_downloading = false;
+
+            foreach(DownloadSegment *other, m_segments)
+                other->abort();
+        }
+    }
+    else if(segment->isComplete() || segment->hasProgress())
+        m_failures = 0;
+    else if(++m_failures >= maxFailures && m_downloading)
+    {
+        qDebug() << "Too many errors while downloading " << m_info.gameName;
+        m_downloading = false;
+
+        foreach(DownloadSegment *other, m_segments)
+            other->abort();
+    }
+
+    segment->deleteLater();
+
+    if(m_downloading)
+        downloadNextRange();
+    else if(m_segments.isEmpty())
+        finishDownload();
 }
 
 void DownloadItem::updateDataTransferProgress(qint64 readBytes, qint64 totalBytes)
 {
-    int percentage = (int)(((readBytes + m_startOffset) * 100) / (totalBytes + m_startOffset));
+    Q_UNUSED(totalBytes);
+
+    // the segments only cover the missing ranges, the progress is for the whole package
+    int percentage = m_info.packageSize > 0 ? (int)(((readBytes + m_startOffset) * 100) / m_info.packageSize) : 0;
     ui->progressBar->setMaximum(100);
     ui->progressBar->setValue(percentage);
     m_downloaded = readBytes + m_startOffset;
     ui->downloadedLabel->setText(readable_size(m_downloaded, true));
 }
 
-void DownloadItem::readError(QNetworkReply::NetworkError code)
+/**
+ * @brief DownloadItem::finishDownload
+ * All the segments are done, because the package is complete or the
+ * download was stopped
+ */
+void DownloadItem::finishDownload()
 {
-    if(code == QNetworkReply::OperationCanceledError)
-        qDebug() << "Download canceled: " << m_info.gameName;
-    else
-        qDebug() << "Error while downloading " << m_info.gameName << ": " << code;
-}
+    PackageIndex *index = PackageIndex::instance();
+    PackageEntry entry;
 
-void DownloadItem::savePkgPart()
-{
-    QByteArray data = m_reply->readAll();
-    m_file->write(data);
-}
+    FetchRegistry::instance()->cancel(this);
+    m_downloading = false;
 
-void DownloadItem::packageComplete()
-{
-    if(m_reply->isReadable())
+    if(m_writing)
+    {
+        m_writing = false;
+        index->endWrite(m_pkgname);
+        index->update(m_pkgname);
+    }
+
+    if(m_mismatch)
+    {
+        m_mismatch = false;
+        index->clearRanges(m_pkgname);
+
+        if(m_queued && m_connectionLimit > 0)
+        {
+            startDownload();
+            return;
+        }
+    }
+
+    bool complete = index->find(m_pkgname, entry) && entry.isComplete();
+
+    // preempted by the scheduler, it continues once it gets a connection
+    if(m_queued && m_connectionLimit == 0 && !complete)
+    {
+        ui->downloadButton->setIcon(QIcon(":/main/resources/images/appointment-new.svg"));
+        return;
+    }
+
+    if(m_queued)
+    {
+        m_queued = false;
+        m_connectionLimit = 0;
+        DownloadScheduler::instance()->remove(this);
+    }
+
+    if(complete)
     {
-        QByteArray data = m_reply->readAll();
-        m_file->write(data);
-        m_startOffset = m_info.packageSize;        
+        m_startOffset = m_info.packageSize;
+        m_received = 0;
+        updateDataTransferProgress(0, 0);
         qDebug() << "Download complete: " << m_info.gameName;
+        ui->downloadButton->setIcon(QIcon(":/main/resources/images/dialog-ok-apply.svg"));
     }
     else
     {
         qDebug() << "Download interrupted for " << m_info.gameName << ": " << m_downloaded << " bytes";
+        ui->downloadButton->setIcon(QIcon(":/main/resources/images/media-playback-start.svg"));
     }
 
-    m_file->close();
-    delete m_file;
-    m_file = NULL;
-    m_downloading = false;
-    ui->downloadButton->setIcon(QIcon(":/main/resources/images/dialog-ok-apply.svg"));
-    ui->deleteButton->setEnabled(true);
-}
-
-void DownloadItem::resetDownloadState()
-{
-    m_file->close();
-    delete m_file;
-    m_file = NULL;
-    m_startOffset = 0;
-    m_downloading = false;
-    ui->downloadButton->setIcon(QIcon(":/main/resources/images/media-playback-start.svg"));
     ui->deleteButton->setEnabled(true);
 }
 
@@ -306,10 +656,12 @@ void DownloadItem::deletePackage()
                                     QMessageBox::Cancel);
     if(ret == QMessageBox::Ok)
     {
+        m_pkginfo.refresh();
         if(m_pkginfo.exists())
         {
             if(QFile(m_pkginfo.absoluteFilePath()).remove())
             {
+                PackageIndex::instance()->update(m_pkgname);
                 m_startOffset = 0;
                 updateDataTransferProgress(0, m_info.packageSize);
                 ui->downloadButton->setIcon(QIcon(":/main/resources/images/media-playback-start.svg"));
@@ -328,15 +680,17 @@ void DownloadItem::deletePackage()
 
 int DownloadItem::status()
 {
-   if(!m_downloading)
-       if(m_downloaded == 0)
-           return 1; // new
-        else if(m_downloaded == m_info.packageSize)
-           return 3; // complete
-        else
-           return 4; // paused
-   else
-       return 2; //downloading
+    if(m_downloading || m_queued)
+        return 2; // downloading
+
+    // the stored data is known by the index, the file isn't checked
+    PackageEntry entry;
+    if(!PackageIndex::instance()->find(m_pkgname, entry) || entry.ranges.isEmpty())
+        return 1; // new
+    else if(entry.isComplete())
+        return 3; // complete
+    else
+        return 4; // paused
 }
 
 void DownloadItem::setWaitingIcon(bool )
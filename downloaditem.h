@@ -22,7 +22,7 @@
 #define DOWNLOADITEM_H
 
 #include "psnparser.h"
-#include "psnparser.h"
+#include "downloadscheduler.h"
 
 #include <QFile>
 #include <QFileInfo>
@@ -33,6 +33,8 @@ namespace Ui {
 class DownloadItem;
 }
 
+class DownloadSegment;
+
 class DownloadItem : public QWidget
 {
     Q_OBJECT
@@ -49,12 +51,22 @@ public:
     static QString getPackageDir();
     static bool lessThan(const DownloadItem *s1, const DownloadItem *s2);
 
+    void setConnectionLimit(int limit);
+    qint64 remainingBytes() const;
+    DownloadScheduler::Priority priority() const;
+
     QNetworkAccessManager *m_manager;
 
+protected:
+    void contextMenuEvent(QContextMenuEvent *event);
+
 private:
     void init();    
     QByteArray downloadTask(const QString &path);
-    void resetDownloadState();
+    void startDownload();
+    void stopDownload();
+    bool startSegment(DownloadSegment *segment, qint64 end);
+    void finishDownload();
 
     TitleInfo m_info;
     QString m_pkgname;
@@ -62,9 +74,16 @@ private:
     QString m_storeRoot;
     QNetworkReply *m_reply;
     QNetworkReply::NetworkError m_error;
-    QFile *m_file;
+    QList<DownloadSegment *> m_segments;
     bool m_downloading;
+    bool m_writing;
+    bool m_mismatch;
+    bool m_queued;
+    int m_connectionLimit;
+    DownloadScheduler::Priority m_priority;
+    int m_failures;
     qint64 m_startOffset;
+    qint64 m_received;
     qint64 m_downloaded;
     Ui::DownloadItem *ui;
 
@@ -72,11 +91,11 @@ private slots:
     void loadGameIcon();
     void clipboardCopy();
     void setLastError(QNetworkReply::NetworkError code);
-    void readError(QNetworkReply::NetworkError code);
     void updateDataTransferProgress(qint64 readBytes, qint64 totalBytes);
     void downloadPackage();
-    void savePkgPart();
-    void packageComplete();    
+    void downloadNextRange();
+    void segmentProgress(qint64 bytes);
+    void segmentFinished();
     void deletePackage();
 };
 
@@ -0,0 +1,182 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "downloadscheduler.h"
+#include "downloaditem.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QHash>
+#include <QSettings>
+#include <QUrl>
+
+#include <algorithm>
+
+// upper limit of the parallel connections of a download
+static const int maxItemConnections = 16;
+
+class JobLessThan
+{
+public:
+    explicit JobLessThan(DownloadScheduler::Policy policy) : m_policy(policy) {}
+
+    template<typename T>
+    bool operator()(const T &a, const T &b) const
+    {
+        if(a.item->priority() != b.item->priority())
+            return a.item->priority() < b.item->priority();
+
+        if(m_policy == DownloadScheduler::ShortestFirst && a.remaining != b.remaining)
+            return a.remaining < b.remaining;
+
+        return a.order < b.order;
+    }
+
+private:
+    DownloadScheduler::Policy m_policy;
+};
+
+DownloadScheduler::DownloadScheduler(QObject *parent) :
+    QObject(parent), m_counter(0), m_paused(false), m_scheduled(false),
+    m_maxConnections(8), m_maxHostConnections(8), m_itemConnections(4), m_policy(Fifo)
+{
+    loadSettings();
+}
+
+DownloadScheduler *DownloadScheduler::instance()
+{
+    static DownloadScheduler *scheduler = new DownloadScheduler(QCoreApplication::instance());
+    return scheduler;
+}
+
+void DownloadScheduler::loadSettings()
+{
+    QSettings settings;
+    m_maxConnections = qMax(1, settings.value("maxDownloadConnections", 8).toInt());
+    m_maxHostConnections = qMax(1, settings.value("maxHostConnections", 8).toInt());
+    m_itemConnections = qBound(1, settings.value("downloadSegments", 4).toInt(), maxItemConnections);
+    m_policy = Policy(settings.value("downloadPolicy", Fifo).toInt());
+    reschedule();
+}
+
+/**
+ * @brief DownloadScheduler::enqueue
+ * Add a download at the end of the queue, it starts as soon as it gets a
+ * connection
+ */
+void DownloadScheduler::enqueue(DownloadItem *item)
+{
+    foreach(const Job &job, m_jobs)
+    {
+        if(job.item == item)
+            return;
+    }
+
+    Job job;
+    job.item = item;
+    job.order = m_counter++;
+    job.remaining = 0;
+    m_jobs << job;
+    reschedule();
+}
+
+/**
+ * @brief DownloadScheduler::remove
+ * The download finished or was stopped, its connections are given to the
+ * rest of the queue
+ */
+void DownloadScheduler::remove(DownloadItem *item)
+{
+    for(int i = 0; i < m_jobs.size(); i++)
+    {
+        if(m_jobs.at(i).item == item)
+        {
+            m_jobs.removeAt(i);
+            reschedule();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief DownloadScheduler::reschedule
+ * Distribute the connections again once control returns to the event
+ * loop, the changes done meanwhile are applied at once
+ */
+void DownloadScheduler::reschedule()
+{
+    if(!m_scheduled)
+    {
+        m_scheduled = true;
+        QMetaObject::invokeMethod(this, "schedule", Qt::QueuedConnection);
+    }
+}
+
+bool DownloadScheduler::isPaused() const
+{
+    return m_paused;
+}
+
+void DownloadScheduler::pauseAll()
+{
+    if(m_paused)
+        return;
+
+    m_paused = true;
+    emit pausedChanged(true);
+    reschedule();
+}
+
+void DownloadScheduler::resumeAll()
+{
+    if(!m_paused)
+        return;
+
+    m_paused = false;
+    emit pausedChanged(false);
+    reschedule();
+}
+
+void DownloadScheduler::schedule()
+{
+    m_scheduled = false;
+
+    for(QList<Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it)
+        it->remaining = it->item->remainingBytes();
+
+    std::stable_sort(m_jobs.begin(), m_jobs.end(), JobLessThan(m_policy));
+
+    int available = m_paused ? 0 : m_maxConnections;
+    QHash<QString, int> hosts;
+
+    // the items can leave the queue while their share is applied
+    QList<Job> jobs = m_jobs;
+
+    foreach(const Job &job, jobs)
+    {
+        QString host = QUrl(job.item->getInfo().packageUrl).host();
+        int share = qMin(qMin(m_itemConnections, available), m_maxHostConnections - hosts.value(host, 0));
+        share = qMax(share, 0);
+
+        hosts[host] += share;
+        available -= share;
+        job.item->setConnectionLimit(share);
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DOWNLOADSCHEDULER_H
+#define DOWNLOADSCHEDULER_H
+
+#include <QList>
+#include <QObject>
+
+class DownloadItem;
+
+/**
+ * Queue of the package downloads of the download list. The scheduler
+ * decides how many connections each download can use, so the downloads
+ * don't starve each other: the queue is ordered by priority and then by
+ * arrival or by the amount of data left, and the connections are handed
+ * out in that order within the global and per host limits. The downloads
+ * start, shrink or stop when their share changes.
+ */
+class DownloadScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Priority
+    {
+        High,
+        Normal,
+        Low
+    };
+
+    enum Policy
+    {
+        Fifo,
+        ShortestFirst
+    };
+
+    static DownloadScheduler *instance();
+
+    void enqueue(DownloadItem *item);
+    void remove(DownloadItem *item);
+    void reschedule();
+    bool isPaused() const;
+
+public slots:
+    void pauseAll();
+    void resumeAll();
+    void loadSettings();
+
+signals:
+    void pausedChanged(bool paused);
+
+private slots:
+    void schedule();
+
+private:
+    explicit DownloadScheduler(QObject *parent = 0);
+
+    struct Job
+    {
+        DownloadItem *item;
+        qint64 order;
+        qint64 remaining;
+    };
+
+    QList<Job> m_jobs;
+    qint64 m_counter;
+    bool m_paused;
+    bool m_scheduled;
+    int m_maxConnections;
+    int m_maxHostConnections;
+    int m_itemConnections;
+    Policy m_policy;
+};
+
+#endif // DOWNLOADSCHEDULER_H
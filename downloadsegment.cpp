@@ -0,0 +1,287 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "downloadsegment.h"
+#include "bandwidthlimiter.h"
+#include "diskwriter.h"
+#include "fetchregistry.h"
+#include "packageindex.h"
+#include "packagewriter.h"
+
+#include <QDebug>
+
+#include <limits>
+#include <string.h>
+
+// data kept on the reply while the download is throttled
+static const qint64 readBufferSize = 1024 * 1024;
+
+DownloadSegment::DownloadSegment(const QString &name, const QString &path, qint64 start, QObject *parent) :
+    QObject(parent), m_name(name), m_path(path), m_writer(NULL), m_reply(NULL), m_start(start), m_requestStart(start), m_mismatch(false), m_position(start), m_end(start)
+{
+    m_throttle.setSingleShot(true);
+    connect(&m_throttle, SIGNAL(timeout()), this, SLOT(readData()));
+
+    // the data waits on the reply while the disk catches up
+    connect(DiskWriter::instance(), SIGNAL(drained()), this, SLOT(readData()));
+}
+
+DownloadSegment::~DownloadSegment()
+{
+    if(m_reply != NULL)
+    {
+        m_reply->disconnect(this);
+        m_reply->abort();
+        m_reply->deleteLater();
+    }
+
+    // the data already received is still written
+    if(m_writer != NULL)
+        m_writer->finish();
+
+    FetchRegistry::instance()->cancel(this);
+}
+
+/**
+ * @brief DownloadSegment::start
+ * Request the range from the start of the segment up to end
+ * @param request request for the whole package
+ * @param overlap amount of stored data right before the segment that is
+ * downloaded again and compared, the segment stops if it doesn't match
+ * @return false if the package file can't be written
+ */
+bool DownloadSegment::start(QNetworkAccessManager *manager, QNetworkRequest request, qint64 end, qint64 overlap)
+{
+    m_end = end;
+
+    m_writer = new PackageWriter(m_name, m_path);
+
+    if(!m_writer->open())
+    {
+        qDebug() << "Cannot open " << m_name << ": " << m_writer->errorString();
+        m_writer->deleteLater();
+        m_writer = NULL;
+        return false;
+    }
+
+    // the segment finishes once its data is on disk
+    connect(m_writer, SIGNAL(failed(QString)), this, SLOT(writeFailed(QString)));
+    connect(m_writer, SIGNAL(closed()), this, SIGNAL(finished()));
+    DiskWriter::instance()->attach(m_writer);
+
+    if(overlap > 0)
+    {
+        QFile file(m_path);
+        if(file.open(QIODevice::ReadOnly) && file.seek(m_position - overlap))
+            m_overlap = file.read(overlap);
+
+        if(m_overlap.size() != overlap)
+            m_overlap.clear();
+    }
+
+    m_requestStart = m_position - m_overlap.size();
+    request.setRawHeader("Range", "bytes=" + QByteArray::number(m_requestStart) + "-" + QByteArray::number(m_end - 1));
+    m_reply = manager->get(request);
+    m_reply->setReadBufferSize(readBufferSize);
+    m_timer.start();
+
+    connect(m_reply, SIGNAL(readyRead()), this, SLOT(readData()));
+    connect(m_reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+    return true;
+}
+
+void DownloadSegment::abort()
+{
+    if(m_reply != NULL)
+        stop();
+}
+
+/**
+ * @brief DownloadSegment::split
+ * Give the second half of the remaining data to another segment
+ * @param minimum smallest amount of data left to each segment
+ * @return start of the second half, or -1 if the segment is too small
+ */
+qint64 DownloadSegment::split(qint64 minimum)
+{
+    qint64 left = remaining();
+
+    if(m_reply == NULL || left < 2 * minimum)
+        return -1;
+
+    m_end = m_position + left / 2;
+    return m_end;
+}
+
+qint64 DownloadSegment::position() const
+{
+    return m_position;
+}
+
+qint64 DownloadSegment::end() const
+{
+    return m_end;
+}
+
+qint64 DownloadSegment::remaining() const
+{
+    return m_end - m_position;
+}
+
+/**
+ * @brief DownloadSegment::timeLeft
+ * @return estimated milliseconds to finish the segment at the current
+ * speed, a segment without data yet is considered the slowest
+ */
+qint64 DownloadSegment::timeLeft() const
+{
+    qint64 received = m_position - m_start;
+
+    if(received <= 0)
+        return std::numeric_limits<qint64>::max();
+
+    return remaining() * qMax(m_timer.elapsed(), Q_INT64_C(1)) / received;
+}
+
+bool DownloadSegment::hasProgress() const
+{
+    return m_position > m_start;
+}
+
+bool DownloadSegment::isComplete() const
+{
+    return m_position >= m_end;
+}
+
+/**
+ * @brief DownloadSegment::isMismatch
+ * @return true if the stored data before the segment differs from the
+ * data of the server
+ */
+bool DownloadSegment::isMismatch() const
+{
+    return m_mismatch;
+}
+
+void DownloadSegment::readData()
+{
+    if(m_reply == NULL || isComplete() || DiskWriter::instance()->isFull())
+        return;
+
+    // the rest of the data stays on the reply (and the kernel) until the
+    // limiter lets it through, the timer reads it later
+    qint64 allowed = BandwidthLimiter::instance()->request(BandwidthLimiter::Wan, m_reply->bytesAvailable(), &m_throttle);
+    QByteArray data = m_reply->read(allowed);
+
+    // an error page, or the whole package when the server ignored the
+    // Range header, doesn't belong here. The segment ends without data and
+    // counts as a failure
+    int status = m_reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if(!data.isEmpty() && status != 206 && (status != 200 || m_requestStart > 0))
+    {
+        qDebug() << "Unexpected status " << status << " while downloading " << m_name;
+        stop();
+        return;
+    }
+
+    if(!data.isEmpty() && !m_overlap.isEmpty())
+    {
+        int size = qMin(data.size(), m_overlap.size());
+
+        if(memcmp(data.constData(), m_overlap.constData(), size) != 0)
+        {
+            qDebug() << "Stored data of " << m_name << " doesn't match the server";
+            m_mismatch = true;
+            stop();
+            return;
+        }
+
+        m_overlap.remove(0, size);
+        data.remove(0, size);
+    }
+
+    if(!data.isEmpty())
+    {
+        // the end could have been moved back after the request was sent
+        if(data.size() > remaining())
+            data.truncate(remaining());
+
+        // the validators tell the proxy which version of the package is stored
+        if(m_position == m_start)
+            PackageIndex::instance()->setOrigin(m_name, m_reply->url().toString(), m_reply->rawHeader("ETag"), m_reply->rawHeader("Last-Modified"));
+
+        // the writer adds the data to the range map once it is on disk
+        m_writer->write(m_position, data);
+        m_position += data.size();
+
+        emit progress(data.size());
+    }
+
+    if(isComplete() || (m_reply->isFinished() && m_reply->bytesAvailable() == 0))
+        stop();
+}
+
+void DownloadSegment::replyFinished()
+{
+    // the last part of the data can still be waiting for the limiter
+    if(!isComplete() && m_reply->error() != QNetworkReply::OperationCanceledError && m_reply->bytesAvailable() > 0)
+    {
+        readData();
+        return;
+    }
+
+    finishReply();
+}
+
+void DownloadSegment::writeFailed(const QString &error)
+{
+    qDebug() << "Cannot write " << m_name << ": " << error;
+
+    if(m_reply != NULL)
+        stop();
+}
+
+/**
+ * @brief DownloadSegment::stop
+ * Abort the request, a reply that already finished while its data was
+ * being throttled is closed right away
+ */
+void DownloadSegment::stop()
+{
+    if(m_reply->isFinished())
+        finishReply();
+    else
+        m_reply->abort();
+}
+
+void DownloadSegment::finishReply()
+{
+    if(!isComplete() && m_reply->error() != QNetworkReply::OperationCanceledError)
+        qDebug() << "Error while downloading " << m_name << ": " << m_reply->errorString();
+
+    m_throttle.stop();
+    m_reply->disconnect(this);
+    m_reply->deleteLater();
+    m_reply = NULL;
+
+    // finished is emitted by the writer once the data is on disk
+    m_writer->finish();
+    m_writer = NULL;
+}
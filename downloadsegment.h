@@ -0,0 +1,85 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DOWNLOADSEGMENT_H
+#define DOWNLOADSEGMENT_H
+
+#include <QElapsedTimer>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QObject>
+#include <QTimer>
+
+class PackageWriter;
+
+/**
+ * Range of a package downloaded with its own connection. The data is
+ * written on its position of the package file by the disk thread and
+ * added to the range map once it is on disk, so an interrupted download
+ * resumes from the data already stored. The end of the range can be moved back while the
+ * download is running, to give the rest to another segment.
+ */
+class DownloadSegment : public QObject
+{
+    Q_OBJECT
+public:
+    DownloadSegment(const QString &name, const QString &path, qint64 start, QObject *parent = 0);
+    ~DownloadSegment();
+
+    bool start(QNetworkAccessManager *manager, QNetworkRequest request, qint64 end, qint64 overlap = 0);
+    void abort();
+    qint64 split(qint64 minimum);
+
+    qint64 position() const;
+    qint64 end() const;
+    qint64 remaining() const;
+    qint64 timeLeft() const;
+    bool hasProgress() const;
+    bool isComplete() const;
+    bool isMismatch() const;
+
+signals:
+    void progress(qint64 bytes);
+    void finished();
+
+private slots:
+    void readData();
+    void replyFinished();
+    void writeFailed(const QString &error);
+
+private:
+    void stop();
+    void finishReply();
+
+    QString m_name;
+    QString m_path;
+    PackageWriter *m_writer;
+    QNetworkReply *m_reply;
+    qint64 m_start;
+    qint64 m_requestStart;
+    QByteArray m_overlap;
+    bool m_mismatch;
+    qint64 m_position;
+    qint64 m_end;
+    QElapsedTimer m_timer;
+    QTimer m_throttle;
+};
+
+#endif // DOWNLOADSEGMENT_H
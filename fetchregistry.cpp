@@ -0,0 +1,174 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fetchregistry.h"
+
+#include <QStringList>
+
+FetchRegistry *FetchRegistry::instance()
+{
+    static FetchRegistry registry;
+    return &registry;
+}
+
+/**
+ * @brief FetchRegistry::claim
+ * Register the download of a missing range. If the start of the range
+ * is already being downloaded nothing is registered and member is
+ * invoked on receiver once more data of the package is on disk
+ * @param name package key
+ * @param start first byte of the range
+ * @param end position after the last byte of the range
+ * @param owner object that downloads the range, receiver if NULL
+ * @return end of the claimed range, reduced to the start of the next
+ * download in progress, or -1 if the caller has to wait
+ */
+qint64 FetchRegistry::claim(const QString &name, qint64 start, qint64 end, QObject *receiver, const char *member, QObject *owner)
+{
+    QMutexLocker locker(&m_mutex);
+    QList<Fetch> &fetches = m_fetches[name];
+
+    foreach(const Fetch &fetch, fetches)
+    {
+        if(fetch.start <= start && start < fetch.end)
+        {
+            Waiter waiter;
+            waiter.receiver = receiver;
+            waiter.member = member;
+            m_waiters[name] << waiter;
+            return -1;
+        }
+
+        if(fetch.start > start && fetch.start < end)
+            end = fetch.start;
+    }
+
+    Fetch fetch;
+    fetch.start = start;
+    fetch.end = end;
+    fetch.owner = owner ? owner : receiver;
+    fetches << fetch;
+    return end;
+}
+
+/**
+ * @brief FetchRegistry::add
+ * Register a download that can't wait for the others, like a response
+ * relayed as is by the proxy
+ */
+void FetchRegistry::add(const QString &name, qint64 start, qint64 end, QObject *owner)
+{
+    Fetch fetch;
+    fetch.start = start;
+    fetch.end = end;
+    fetch.owner = owner;
+
+    QMutexLocker locker(&m_mutex);
+    m_fetches[name] << fetch;
+}
+
+/**
+ * @brief FetchRegistry::release
+ * The downloads of owner are finished or abandoned, the waiters check
+ * again what is missing
+ */
+void FetchRegistry::release(const QString &name, QObject *owner)
+{
+    QMutexLocker locker(&m_mutex);
+    QHash<QString, QList<Fetch> >::iterator it = m_fetches.find(name);
+
+    if(it == m_fetches.end())
+        return;
+
+    for(int i = it->size() - 1; i >= 0; i--)
+    {
+        if(it->at(i).owner == owner)
+            it->removeAt(i);
+    }
+
+    if(it->isEmpty())
+        m_fetches.erase(it);
+
+    wakeWaiters(name);
+}
+
+/**
+ * @brief FetchRegistry::notify
+ * More data of a package was written, called by the writers
+ */
+void FetchRegistry::notify(const QString &name)
+{
+    QMutexLocker locker(&m_mutex);
+    wakeWaiters(name);
+}
+
+/**
+ * @brief FetchRegistry::cancel
+ * Forget about receiver and its downloads, must be called before it is
+ * destroyed
+ */
+void FetchRegistry::cancel(QObject *receiver)
+{
+    QMutexLocker locker(&m_mutex);
+
+    for(QHash<QString, QList<Waiter> >::iterator it = m_waiters.begin(); it != m_waiters.end(); ++it)
+    {
+        for(int i = it->size() - 1; i >= 0; i--)
+        {
+            if(it->at(i).receiver == receiver)
+                it->removeAt(i);
+        }
+    }
+
+    QStringList released;
+
+    for(QHash<QString, QList<Fetch> >::iterator it = m_fetches.begin(); it != m_fetches.end(); ++it)
+    {
+        for(int i = it->size() - 1; i >= 0; i--)
+        {
+            if(it->at(i).owner == receiver)
+            {
+                it->removeAt(i);
+                released << it.key();
+            }
+        }
+    }
+
+    foreach(const QString &name, released)
+        wakeWaiters(name);
+}
+
+/**
+ * @brief FetchRegistry::wakeWaiters
+ * Must be called with the mutex held. The waiters are removed, they
+ * register again if the data they need is still missing
+ */
+void FetchRegistry::wakeWaiters(const QString &name)
+{
+    QHash<QString, QList<Waiter> >::iterator it = m_waiters.find(name);
+
+    if(it == m_waiters.end())
+        return;
+
+    foreach(const Waiter &waiter, it.value())
+        QMetaObject::invokeMethod(waiter.receiver, waiter.member.constData(), Qt::QueuedConnection);
+
+    m_waiters.erase(it);
+}
@@ -0,0 +1,70 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FETCHREGISTRY_H
+#define FETCHREGISTRY_H
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+
+/**
+ * Package ranges that are being downloaded from the remote servers,
+ * shared by the proxy connections and the download list. A download
+ * that needs data already on its way waits for it to reach the disk
+ * instead of asking the remote server again, so each byte of a package
+ * crosses the WAN only once.
+ */
+class FetchRegistry
+{
+public:
+    static FetchRegistry *instance();
+
+    qint64 claim(const QString &name, qint64 start, qint64 end, QObject *receiver, const char *member, QObject *owner = NULL);
+    void add(const QString &name, qint64 start, qint64 end, QObject *owner);
+    void release(const QString &name, QObject *owner);
+    void notify(const QString &name);
+    void cancel(QObject *receiver);
+
+private:
+    FetchRegistry() {}
+
+    struct Fetch
+    {
+        qint64 start;
+        qint64 end;
+        QObject *owner;
+    };
+
+    struct Waiter
+    {
+        QObject *receiver;
+        QByteArray member;
+    };
+
+    void wakeWaiters(const QString &name);
+
+    QMutex m_mutex;
+    QHash<QString, QList<Fetch> > m_fetches;
+    QHash<QString, QList<Waiter> > m_waiters;
+};
+
+#endif // FETCHREGISTRY_H
@@ -0,0 +1,159 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "filesender.h"
+#include "bandwidthlimiter.h"
+#include "mmapfilesender.h"
+
+#ifdef Q_OS_LINUX
+#include "sendfilesender.h"
+#endif
+
+#include <QDebug>
+#include <QSettings>
+
+// amount of data read from the file on each step
+static const qint64 chunkSize = 64 * 1024;
+
+FileSender::FileSender(QTcpSocket *socket, QFile *file, QObject *parent) :
+    QObject(parent), m_socket(socket), m_file(file),
+    m_offset(0), m_remaining(0), m_sent(0), m_active(false)
+{
+    connect(m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(transfer()));
+
+    // the data sent to the consoles is paced by the LAN limit
+    m_throttle.setSingleShot(true);
+    connect(&m_throttle, SIGNAL(timeout()), this, SLOT(transfer()));
+}
+
+/**
+ * @brief FileSender::preferredMethod
+ * @return the best method available for the current platform, allowed
+ * by the settings
+ */
+FileSender::Method FileSender::preferredMethod()
+{
+    QSettings settings;
+
+#ifdef Q_OS_LINUX
+    if(settings.value("zeroCopyTransfer", true).toBool())
+        return Sendfile;
+#endif
+    if(settings.value("mappedTransfer", true).toBool())
+        return Mapped;
+
+    return Copy;
+}
+
+/**
+ * @brief FileSender::create
+ * Creates a sender using the given method
+ * @param socket destination socket, must be connected
+ * @param file source file, must be open
+ * @param method see preferredMethod()
+ * @return a new sender
+ */
+FileSender *FileSender::create(QTcpSocket *socket, QFile *file, Method method, QObject *parent)
+{
+#ifdef Q_OS_LINUX
+    if(method == Sendfile)
+        return new SendfileSender(socket, file, parent);
+#endif
+    if(method == Mapped || method == Sendfile)
+        return new MmapFileSender(socket, file, parent);
+
+    return new FileSender(socket, file, parent);
+}
+
+/**
+ * @brief FileSender::send
+ * Start sending a range of the file, finished() is emitted once all the
+ * data was handed to the socket
+ * @param offset position of the first byte to send
+ * @param length number of bytes to send
+ */
+void FileSender::send(qint64 offset, qint64 length)
+{
+    m_offset = offset;
+    m_remaining = length;
+    m_active = true;
+    transfer();
+}
+
+qint64 FileSender::bytesSent() const
+{
+    return m_sent;
+}
+
+/**
+ * @brief FileSender::transfer
+ * Read the next chunk of the file and queue it on the socket, only when
+ * the previous chunk was already written
+ */
+void FileSender::transfer()
+{
+    if(!m_active || m_socket->bytesToWrite() >= chunkSize)
+        return;
+
+    if(m_remaining == 0)
+    {
+        complete();
+        return;
+    }
+
+    // the timer calls transfer again once the limiter allows more data
+    qint64 length = BandwidthLimiter::instance()->request(BandwidthLimiter::Lan, qMin(m_remaining, chunkSize), &m_throttle);
+    if(length == 0)
+        return;
+
+    if(!m_file->seek(m_offset))
+    {
+        fail();
+        return;
+    }
+
+    QByteArray buffer = m_file->read(length);
+
+    if(buffer.isEmpty() || m_socket->write(buffer) != buffer.size())
+    {
+        fail();
+        return;
+    }
+
+    m_offset += buffer.size();
+    m_remaining -= buffer.size();
+    m_sent += buffer.size();
+
+    if(m_remaining == 0)
+        complete();
+}
+
+void FileSender::complete()
+{
+    m_active = false;
+    emit finished();
+}
+
+void FileSender::fail()
+{
+    qDebug() << "File transfer failed at offset" << m_offset << ":" << m_socket->errorString();
+    m_active = false;
+    emit failed();
+}
@@ -0,0 +1,69 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILESENDER_H
+#define FILESENDER_H
+
+#include <QFile>
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+
+/**
+ * Sends a byte range of a local file to a socket. This implementation
+ * copies the data through a small user space buffer and is paced by the
+ * bytesWritten signal of the socket, platform specific subclasses can
+ * override transfer() to avoid the copies.
+ */
+class FileSender : public QObject
+{
+    Q_OBJECT
+public:
+    enum Method {Copy, Mapped, Sendfile};
+
+    explicit FileSender(QTcpSocket *socket, QFile *file, QObject *parent = 0);
+
+    static Method preferredMethod();
+    static FileSender *create(QTcpSocket *socket, QFile *file, Method method, QObject *parent = 0);
+
+    void send(qint64 offset, qint64 length);
+    qint64 bytesSent() const;
+
+signals:
+    void finished();
+    void failed();
+
+protected slots:
+    virtual void transfer();
+
+protected:
+    void complete();
+    void fail();
+
+    QTcpSocket *m_socket;
+    QTimer m_throttle;
+    QFile *m_file;
+    qint64 m_offset;
+    qint64 m_remaining;
+    qint64 m_sent;
+    bool m_active;
+};
+
+#endif // FILESENDER_H
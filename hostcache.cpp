@@ -0,0 +1,246 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hostcache.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QHostAddress>
+#include <QSettings>
+
+// failed lookups are remembered for a short time only
+static const qint64 negativeTtl = 10 * 1000;
+
+// maximum entries kept, the expired ones are dropped first
+static const int maxEntries = 256;
+
+HostCache::HostCache(QObject *parent) :
+    QObject(parent), m_hits(0), m_misses(0), m_lookupCount(0), m_lookupTime(0)
+{
+    qRegisterMetaType<QHostInfo>("QHostInfo");
+
+    // QHostInfo doesn't report the TTL of the records, use a fixed one
+    QSettings settings;
+    m_ttl = settings.value("dnsCacheTtl", 300).toInt() * 1000;
+    m_staleTime = settings.value("dnsStaleTime", 3600).toInt() * 1000;
+}
+
+/**
+ * @brief HostCache::instance
+ * The first call must be done from the main thread, it is done by the
+ * ProxyServer constructor
+ * @return the shared cache
+ */
+HostCache *HostCache::instance()
+{
+    static HostCache *cache = new HostCache(QCoreApplication::instance());
+    return cache;
+}
+
+/**
+ * @brief HostCache::lookup
+ * Resolve a hostname. If there is an usable entry it is returned right
+ * away, otherwise member is invoked on receiver with a QHostInfo argument
+ * once the lookup completes
+ * @param name hostname or IP address
+ * @param info filled with the cached result
+ * @param receiver object notified of the result, see cancel()
+ * @param member slot name, without signature
+ * @return true if info holds the result, false if the lookup is pending
+ */
+bool HostCache::lookup(const QString &name, QHostInfo &info, QObject *receiver, const char *member)
+{
+    QHostAddress address;
+
+    // nothing to resolve
+    if(address.setAddress(name))
+    {
+        info = QHostInfo();
+        info.setHostName(name);
+        info.setAddresses(QList<QHostAddress>() << address);
+        return true;
+    }
+
+    QString key = name.toLower();
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&m_mutex);
+    Entry &entry = m_entries[key];
+
+    if(entry.valid)
+    {
+        if(now < entry.expires)
+        {
+            m_hits++;
+            info = entry.info;
+            return true;
+        }
+
+        // stale entries are used while the new lookup is running
+        if(entry.info.error() == QHostInfo::NoError && now < entry.expires + m_staleTime)
+        {
+            m_hits++;
+            info = entry.info;
+            refresh(key, entry);
+            return true;
+        }
+    }
+
+    m_misses++;
+
+    Waiter waiter;
+    waiter.receiver = receiver;
+    waiter.member = member;
+    entry.waiters << waiter;
+
+    refresh(key, entry);
+    return false;
+}
+
+/**
+ * @brief HostCache::cancel
+ * Forget about receiver, must be called before it is destroyed
+ */
+void HostCache::cancel(QObject *receiver)
+{
+    QMutexLocker locker(&m_mutex);
+
+    for(QHash<QString, Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        for(int i = it->waiters.size() - 1; i >= 0; i--)
+        {
+            if(it->waiters[i].receiver == receiver)
+                it->waiters.removeAt(i);
+        }
+    }
+}
+
+/**
+ * @brief HostCache::demote
+ * Move an address that couldn't be connected to the end of the entry,
+ * the next connections try the other addresses first
+ */
+void HostCache::demote(const QString &name, const QHostAddress &address)
+{
+    QMutexLocker locker(&m_mutex);
+    QHash<QString, Entry>::iterator it = m_entries.find(name.toLower());
+
+    if(it == m_entries.end() || !it->valid)
+        return;
+
+    QList<QHostAddress> addresses = it->info.addresses();
+    if(addresses.size() < 2 || !addresses.removeOne(address))
+        return;
+
+    addresses << address;
+    it->info.setAddresses(addresses);
+}
+
+void HostCache::refresh(const QString &name, Entry &entry)
+{
+    if(entry.pending)
+        return;
+
+    entry.pending = true;
+    entry.started = QDateTime::currentMSecsSinceEpoch();
+
+    // the lookup is started on the thread of the cache
+    QMetaObject::invokeMethod(this, "startLookup", Qt::QueuedConnection, Q_ARG(QString, name));
+}
+
+void HostCache::startLookup(const QString &name)
+{
+    int id = QHostInfo::lookupHost(name, this, SLOT(lookupFinished(QHostInfo)));
+
+    QMutexLocker locker(&m_mutex);
+    m_lookups.insert(id, name);
+}
+
+void HostCache::lookupFinished(const QHostInfo &info)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&m_mutex);
+    QString name = m_lookups.take(info.lookupId());
+
+    QHash<QString, Entry>::iterator it = m_entries.find(name);
+    if(it == m_entries.end())
+        return;
+
+    Entry &entry = it.value();
+    bool failed = info.error() != QHostInfo::NoError || info.addresses().isEmpty();
+
+    m_lookupCount++;
+    m_lookupTime += now - entry.started;
+
+    // a temporary failure doesn't replace a stale entry still in use
+    if(!failed || !entry.valid || entry.info.error() != QHostInfo::NoError)
+    {
+        entry.info = info;
+        entry.valid = true;
+        entry.expires = now + (failed ? negativeTtl : m_ttl);
+    }
+
+    entry.pending = false;
+
+    if(failed)
+        qDebug() << "Cannot resolve" << name << info.errorString();
+
+    foreach(const Waiter &waiter, entry.waiters)
+        QMetaObject::invokeMethod(waiter.receiver, waiter.member.constData(), Qt::QueuedConnection,
+                                  Q_ARG(QHostInfo, entry.info));
+    entry.waiters.clear();
+
+    if(m_entries.size() > maxEntries)
+    {
+        for(it = m_entries.begin(); it != m_entries.end();)
+        {
+            if(!it->pending && it->expires + m_staleTime < now)
+                it = m_entries.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    qDebug("DNS cache: %d hits, %d misses, %lld ms average lookup", m_hits, m_misses,
+           m_lookupCount > 0 ? m_lookupTime / m_lookupCount : 0);
+}
+
+int HostCache::hits() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_hits;
+}
+
+int HostCache::misses() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_misses;
+}
+
+/**
+ * @brief HostCache::averageLookupTime
+ * @return average time spent on a lookup, in milliseconds. Each hit saves
+ * about this much on the connection setup
+ */
+qint64 HostCache::averageLookupTime() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lookupCount > 0 ? m_lookupTime / m_lookupCount : 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOSTCACHE_H
+#define HOSTCACHE_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QHostInfo>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+
+/**
+ * Resolved addresses of the remote servers, shared by all the proxy worker
+ * threads. Lookups are done asynchronously on the thread of the cache and
+ * concurrent requests for the same name wait for a single lookup. Expired
+ * entries are still used while a new lookup refreshes them.
+ */
+class HostCache : public QObject
+{
+    Q_OBJECT
+public:
+    static HostCache *instance();
+
+    bool lookup(const QString &name, QHostInfo &info, QObject *receiver, const char *member);
+    void cancel(QObject *receiver);
+    void demote(const QString &name, const QHostAddress &address);
+
+    int hits() const;
+    int misses() const;
+    qint64 averageLookupTime() const;
+
+private slots:
+    void startLookup(const QString &name);
+    void lookupFinished(const QHostInfo &info);
+
+private:
+    explicit HostCache(QObject *parent = 0);
+
+    struct Waiter
+    {
+        QObject *receiver;
+        QByteArray member;
+    };
+
+    struct Entry
+    {
+        Entry() : expires(0), started(0), valid(false), pending(false) {}
+
+        QHostInfo info;
+        qint64 expires;
+        qint64 started;
+        bool valid;
+        bool pending;
+        QList<Waiter> waiters;
+    };
+
+    void refresh(const QString &name, Entry &entry);
+
+    mutable QMutex m_mutex;
+    QHash<QString, Entry> m_entries;
+    QHash<int, QString> m_lookups;
+    qint64 m_ttl;
+    qint64 m_staleTime;
+    int m_hits;
+    int m_misses;
+    int m_lookupCount;
+    qint64 m_lookupTime;
+};
+
+#endif // HOSTCACHE_H
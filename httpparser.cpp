@@ -0,0 +1,516 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "httpparser.h"
+
+// limits to protect against misbehaving peers
+static const int maxHeadSize = 64 * 1024;
+static const int maxLineSize = 8 * 1024;
+
+HttpMessage::HttpMessage() :
+    statusCode(0)
+{
+}
+
+void HttpMessage::clear()
+{
+    method.clear();
+    target.clear();
+    statusCode = 0;
+    reason.clear();
+    version.clear();
+    headers.clear();
+}
+
+bool HttpMessage::isRequest() const
+{
+    return !method.isEmpty();
+}
+
+/**
+ * @brief HttpMessage::keepAlive
+ * @return true if the connection can be reused after this message
+ */
+bool HttpMessage::keepAlive() const
+{
+    // Proxy-Connection is not standard but still sent by some clients
+    QByteArray connection = (header("Connection") + "," + header("Proxy-Connection")).toLower();
+
+    if(version == "HTTP/1.0")
+        return connection.contains("keep-alive");
+
+    return !connection.contains("close");
+}
+
+QByteArray HttpMessage::header(const QByteArray &name) const
+{
+    for(int i = 0; i < headers.size(); i++)
+    {
+        if(qstricmp(headers[i].first.constData(), name.constData()) == 0)
+            return headers[i].second;
+    }
+    return QByteArray();
+}
+
+bool HttpMessage::hasHeader(const QByteArray &name) const
+{
+    for(int i = 0; i < headers.size(); i++)
+    {
+        if(qstricmp(headers[i].first.constData(), name.constData()) == 0)
+            return true;
+    }
+    return false;
+}
+
+void HttpMessage::setHeader(const QByteArray &name, const QByteArray &value)
+{
+    for(int i = 0; i < headers.size(); i++)
+    {
+        if(qstricmp(headers[i].first.constData(), name.constData()) == 0)
+        {
+            headers[i].second = value;
+            return;
+        }
+    }
+    headers << qMakePair(name, value);
+}
+
+void HttpMessage::removeHeader(const QByteArray &name)
+{
+    for(int i = headers.size() - 1; i >= 0; i--)
+    {
+        if(qstricmp(headers[i].first.constData(), name.constData()) == 0)
+            headers.removeAt(i);
+    }
+}
+
+/**
+ * @brief HttpMessage::toByteArray
+ * @return the start line and the headers, ready to be sent
+ */
+QByteArray HttpMessage::toByteArray() const
+{
+    QByteArray data;
+
+    if(isRequest())
+        data = method + " " + target + " " + version + "\r\n";
+    else
+        data = version + " " + QByteArray::number(statusCode) + " " + reason + "\r\n";
+
+    for(int i = 0; i < headers.size(); i++)
+        data += headers[i].first + ": " + headers[i].second + "\r\n";
+
+    data += "\r\n";
+    return data;
+}
+
+HttpParser::HttpParser(Type type) :
+    m_type(type)
+{
+    reset();
+}
+
+/**
+ * @brief HttpParser::reset
+ * prepare the parser for the next message of the connection
+ */
+void HttpParser::reset()
+{
+    m_state = HEAD;
+    m_error = 0;
+    m_message.clear();
+    m_scanned = 0;
+    m_bodyMode = NO_BODY;
+    m_chunkState = CHUNK_SIZE;
+    m_contentLength = -1;
+    m_remaining = 0;
+}
+
+/**
+ * @brief HttpParser::setRequestMethod
+ * the framing of a response depends on the method of the request
+ * @param method method of the request being answered
+ */
+void HttpParser::setRequestMethod(const QByteArray &method)
+{
+    m_requestMethod = method;
+}
+
+/**
+ * @brief HttpParser::parseHead
+ * look for a complete message head in the buffer and parse it, the
+ * head is removed from the buffer
+ * @param buffer received data
+ * @return true if the head is complete
+ */
+bool HttpParser::parseHead(QByteArray &buffer)
+{
+    if(m_state != HEAD)
+        return m_state != ERROR;
+
+    // empty lines before a request line must be ignored
+    while(m_scanned == 0 && m_type == REQUEST && !buffer.isEmpty())
+    {
+        if(buffer.startsWith("\r\n"))
+            buffer.remove(0, 2);
+        else if(buffer.startsWith('\n'))
+            buffer.remove(0, 1);
+        else
+            break;
+    }
+
+    int end = -1;
+    int pos = m_scanned;
+
+    // search for the empty line, continuing where the last call stopped
+    while((pos = buffer.indexOf('\n', pos)) != -1)
+    {
+        if(pos + 1 < buffer.size() && buffer.at(pos + 1) == '\n')
+        {
+            end = pos + 2;
+            break;
+        }
+
+        if(pos + 2 < buffer.size() && buffer.at(pos + 1) == '\r' && buffer.at(pos + 2) == '\n')
+        {
+            end = pos + 3;
+            break;
+        }
+
+        // the line after this one is not complete yet
+        if(pos + 2 >= buffer.size())
+            break;
+
+        pos++;
+    }
+
+    if(end == -1)
+    {
+        m_scanned = pos == -1 ? buffer.size() : pos;
+
+        if(buffer.size() > maxHeadSize)
+            setError(m_type == REQUEST ? 431 : 502);
+
+        return false;
+    }
+
+    if(end > maxHeadSize)
+    {
+        setError(m_type == REQUEST ? 431 : 502);
+        return false;
+    }
+
+    QByteArray head = buffer.left(end);
+    buffer.remove(0, end);
+    m_scanned = 0;
+
+    if(!parseHeaders(head))
+    {
+        if(m_state != ERROR)
+            setError(m_type == REQUEST ? 400 : 502);
+        return false;
+    }
+
+    setupBody();
+    return m_state != ERROR;
+}
+
+bool HttpParser::parseStartLine(const QByteArray &line)
+{
+    if(m_type == REQUEST)
+    {
+        // method SP request-target SP HTTP-version
+        QList<QByteArray> tokens = line.split(' ');
+        if(tokens.size() != 3 || tokens[0].isEmpty() || tokens[1].isEmpty())
+            return false;
+
+        m_message.method = tokens[0];
+        m_message.target = tokens[1];
+        m_message.version = tokens[2];
+    }
+    else
+    {
+        // HTTP-version SP status-code SP reason-phrase
+        int first = line.indexOf(' ');
+        if(first == -1)
+            return false;
+
+        int second = line.indexOf(' ', first + 1);
+        QByteArray code = second == -1 ? line.mid(first + 1) : line.mid(first + 1, second - first - 1);
+
+        bool ok;
+        m_message.version = line.left(first);
+        m_message.statusCode = code.toInt(&ok);
+        m_message.reason = second == -1 ? QByteArray() : line.mid(second + 1);
+
+        if(!ok || code.size() != 3)
+            return false;
+    }
+
+    if(!m_message.version.startsWith("HTTP/1."))
+    {
+        setError(m_type == REQUEST ? 505 : 502);
+        return false;
+    }
+
+    return true;
+}
+
+bool HttpParser::parseHeaders(const QByteArray &head)
+{
+    QList<QByteArray> lines = head.split('\n');
+
+    for(int i = 0; i < lines.size(); i++)
+    {
+        QByteArray line = lines[i];
+        if(line.endsWith('\r'))
+            line.chop(1);
+
+        if(i == 0)
+        {
+            if(!parseStartLine(line))
+                return false;
+            continue;
+        }
+
+        if(line.isEmpty())
+            continue;
+
+        // obsolete line folding, the value continues on this line
+        if(line[0] == ' ' || line[0] == '\t')
+        {
+            if(m_message.headers.isEmpty())
+                return false;
+
+            m_message.headers.last().second += " " + line.trimmed();
+            continue;
+        }
+
+        int colon = line.indexOf(':');
+        if(colon <= 0)
+            return false;
+
+        QByteArray name = line.left(colon);
+        if(name.contains(' ') || name.contains('\t'))
+            return false;
+
+        m_message.headers << qMakePair(name, line.mid(colon + 1).trimmed());
+    }
+
+    return true;
+}
+
+/**
+ * @brief HttpParser::setupBody
+ * find out how the end of the body is delimited (RFC 7230 3.3.3)
+ */
+void HttpParser::setupBody()
+{
+    m_bodyMode = NO_BODY;
+    m_contentLength = -1;
+
+    if(m_type == RESPONSE)
+    {
+        int code = m_message.statusCode;
+
+        if(m_requestMethod == "HEAD" || (code >= 100 && code < 200) || code == 204 || code == 304 ||
+                (m_requestMethod == "CONNECT" && code >= 200 && code < 300))
+        {
+            m_state = COMPLETE;
+            return;
+        }
+    }
+
+    QByteArray encoding = m_message.header("Transfer-Encoding").toLower();
+    QByteArray length = m_message.header("Content-Length");
+
+    if(!encoding.isEmpty() && encoding.trimmed().endsWith("chunked"))
+    {
+        m_bodyMode = CHUNKED;
+        m_chunkState = CHUNK_SIZE;
+    }
+    else if(!length.isEmpty())
+    {
+        bool ok;
+        m_contentLength = length.toLongLong(&ok);
+
+        if(!ok || m_contentLength < 0)
+        {
+            setError(m_type == REQUEST ? 400 : 502);
+            return;
+        }
+
+        m_bodyMode = LENGTH;
+        m_remaining = m_contentLength;
+    }
+    else if(m_type == RESPONSE)
+    {
+        m_bodyMode = UNTIL_CLOSE;
+    }
+
+    if(m_bodyMode == NO_BODY || (m_bodyMode == LENGTH && m_remaining == 0))
+        m_state = COMPLETE;
+    else
+        m_state = BODY;
+}
+
+/**
+ * @brief HttpParser::readBody
+ * take the bytes that belong to the body of the current message from the
+ * buffer. Chunked bodies are returned as received, with the chunk framing
+ * @param buffer received data
+ * @return body data, can be empty if more data is needed
+ */
+QByteArray HttpParser::readBody(QByteArray &buffer)
+{
+    QByteArray body;
+
+    if(m_state != BODY || buffer.isEmpty())
+        return body;
+
+    if(m_bodyMode == UNTIL_CLOSE || (m_bodyMode == LENGTH && m_remaining >= buffer.size()))
+    {
+        // the whole buffer belongs to this message, avoid a copy
+        body = buffer;
+        buffer.clear();
+
+        if(m_bodyMode == LENGTH)
+        {
+            m_remaining -= body.size();
+            if(m_remaining == 0)
+                m_state = COMPLETE;
+        }
+        return body;
+    }
+
+    if(m_bodyMode == LENGTH)
+    {
+        body = buffer.left(int(m_remaining));
+        buffer.remove(0, int(m_remaining));
+        m_remaining = 0;
+        m_state = COMPLETE;
+        return body;
+    }
+
+    int pos = 0;
+
+    while(m_state == BODY && pos < buffer.size())
+    {
+        if(m_chunkState == CHUNK_DATA)
+        {
+            int size = int(qMin(m_remaining, qint64(buffer.size() - pos)));
+            pos += size;
+            m_remaining -= size;
+
+            if(m_remaining == 0)
+                m_chunkState = CHUNK_DATA_END;
+            continue;
+        }
+
+        int eol = buffer.indexOf('\n', pos);
+        if(eol == -1)
+        {
+            if(buffer.size() - pos > maxLineSize)
+                setError(m_type == REQUEST ? 400 : 502);
+            break;
+        }
+
+        QByteArray line = buffer.mid(pos, eol - pos).trimmed();
+        pos = eol + 1;
+
+        if(m_chunkState == CHUNK_SIZE)
+        {
+            // chunk extensions are ignored
+            int ext = line.indexOf(';');
+            if(ext != -1)
+                line = line.left(ext).trimmed();
+
+            bool ok;
+            m_remaining = line.toLongLong(&ok, 16);
+
+            if(!ok || m_remaining < 0)
+                setError(m_type == REQUEST ? 400 : 502);
+            else
+                m_chunkState = m_remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+        }
+        else if(m_chunkState == CHUNK_DATA_END)
+        {
+            if(!line.isEmpty())
+                setError(m_type == REQUEST ? 400 : 502);
+            else
+                m_chunkState = CHUNK_SIZE;
+        }
+        else if(line.isEmpty())
+        {
+            // end of the trailer section
+            m_state = COMPLETE;
+        }
+    }
+
+    body = buffer.left(pos);
+    buffer.remove(0, pos);
+    return body;
+}
+
+/**
+ * @brief HttpParser::finishBody
+ * the peer closed the connection, this ends a close delimited body
+ */
+void HttpParser::finishBody()
+{
+    if(m_state == BODY && m_bodyMode == UNTIL_CLOSE)
+        m_state = COMPLETE;
+}
+
+HttpParser::State HttpParser::state() const
+{
+    return m_state;
+}
+
+int HttpParser::errorCode() const
+{
+    return m_error;
+}
+
+bool HttpParser::isCloseDelimited() const
+{
+    return m_bodyMode == UNTIL_CLOSE;
+}
+
+qint64 HttpParser::contentLength() const
+{
+    return m_contentLength;
+}
+
+const HttpMessage &HttpParser::message() const
+{
+    return m_message;
+}
+
+HttpMessage &HttpParser::message()
+{
+    return m_message;
+}
+
+void HttpParser::setError(int code)
+{
+    m_state = ERROR;
+    m_error = code;
+}
@@ -0,0 +1,109 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+class HttpMessage
+{
+public:
+    HttpMessage();
+
+    void clear();
+    bool isRequest() const;
+    bool keepAlive() const;
+
+    QByteArray header(const QByteArray &name) const;
+    bool hasHeader(const QByteArray &name) const;
+    void setHeader(const QByteArray &name, const QByteArray &value);
+    void removeHeader(const QByteArray &name);
+
+    QByteArray toByteArray() const;
+
+    // request line
+    QByteArray method;
+    QByteArray target;
+
+    // status line
+    int statusCode;
+    QByteArray reason;
+
+    QByteArray version;
+    QList<QPair<QByteArray, QByteArray> > headers;
+};
+
+/**
+ * Incremental HTTP/1.x parser. The data is taken from a buffer owned by
+ * the caller as soon as it is parsed, so a message can arrive split in
+ * any number of segments and several messages can be queued in the same
+ * buffer (pipelining).
+ */
+class HttpParser
+{
+public:
+    enum Type {REQUEST, RESPONSE};
+    enum State {HEAD, BODY, COMPLETE, ERROR};
+
+    explicit HttpParser(Type type);
+
+    void reset();
+    void setRequestMethod(const QByteArray &method);
+
+    bool parseHead(QByteArray &buffer);
+    QByteArray readBody(QByteArray &buffer);
+    void finishBody();
+
+    State state() const;
+    int errorCode() const;
+    bool isCloseDelimited() const;
+    qint64 contentLength() const;
+
+    const HttpMessage &message() const;
+    HttpMessage &message();
+
+private:
+    enum BodyMode {NO_BODY, LENGTH, CHUNKED, UNTIL_CLOSE};
+    enum ChunkState {CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER};
+
+    bool parseStartLine(const QByteArray &line);
+    bool parseHeaders(const QByteArray &head);
+    void setupBody();
+    void setError(int code);
+
+    Type m_type;
+    State m_state;
+    int m_error;
+    HttpMessage m_message;
+    QByteArray m_requestMethod;
+
+    // position of the buffer where the search of the end of head continues
+    int m_scanned;
+
+    BodyMode m_bodyMode;
+    ChunkState m_chunkState;
+    qint64 m_contentLength;
+    qint64 m_remaining;
+};
+
+#endif // HTTPPARSER_H
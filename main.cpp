@@ -25,8 +25,17 @@
 #include <QLibraryInfo>
 #include <QTranslator>
 
+#ifdef Q_OS_UNIX
+#include <signal.h>
+#endif
+
 int main(int argc, char *argv[])
 {
+#ifdef Q_OS_UNIX
+    // writes with sendfile(2) raise SIGPIPE when a console drops the connection
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
     QApplication app(argc, argv);
     app.setOrganizationName("codestation");
     app.setApplicationName("QPSNProxy");
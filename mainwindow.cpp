@@ -21,7 +21,10 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "configdialog.h"
+#include "bandwidthlimiter.h"
+#include "diskwriter.h"
 #include "downloaditem.h"
+#include "downloadscheduler.h"
 #include "authdialog.h"
 #include "psnparser.h"
 #include "utils.h"
@@ -75,10 +78,21 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->actionClear_thumbnail_cache, SIGNAL(triggered()), this, SLOT(deleteThumbnailCache()));
     connect(ui->actionOptions, SIGNAL(triggered()), SLOT(openOptions()));
 
+    // the resume button is only enabled while the queue is paused
+    DownloadScheduler *scheduler = DownloadScheduler::instance();
+    connect(ui->pauseButton, SIGNAL(clicked()), scheduler, SLOT(pauseAll()));
+    connect(ui->resumeButton, SIGNAL(clicked()), scheduler, SLOT(resumeAll()));
+    connect(scheduler, SIGNAL(pausedChanged(bool)), ui->resumeButton, SLOT(setEnabled(bool)));
+    connect(scheduler, SIGNAL(pausedChanged(bool)), ui->pauseButton, SLOT(setDisabled(bool)));
+
     connect(ui->actionAbout, SIGNAL(triggered()), this, SLOT(showAboutDialog()));
     connect(ui->actionAbout_Qt, SIGNAL(triggered()), this, SLOT(showAboutQt()));
     connect(ui->actionQuit, SIGNAL(triggered()), this, SLOT(close()));
 
+    // created here so their timer and thread belong to the main thread
+    BandwidthLimiter::instance();
+    DiskWriter::instance();
+
     QThreadPool::globalInstance()->setMaxThreadCount(4);
 
     QByteArray data = loadEntitlements();
@@ -87,7 +101,7 @@ MainWindow::MainWindow(QWidget *parent) :
 
     if(settings.value("autostartProxy", true).toBool())
     {
-        m_proxy = new ProxyServer;
+        m_proxy = new ProxyServer(settings.value("proxyThreads", 0).toInt());
         qint16 port = settings.value("proxyPort", 8888).toInt();
         if(!m_proxy->listen(QHostAddress::Any, port))
         {
@@ -131,7 +145,10 @@ void MainWindow::processStatusList(QVariantList status_list)
 void MainWindow::openOptions()
 {
     ConfigDialog config;
-    config.exec();
+
+    // the proxy workers keep a copy of the settings
+    if(config.exec() == QDialog::Accepted && m_proxy)
+        m_proxy->loadSettings();
 }
 
 void MainWindow::getLoginStatus(int status_code, QString message)
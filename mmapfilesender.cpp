@@ -0,0 +1,241 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mmapfilesender.h"
+#include "bandwidthlimiter.h"
+
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// amount of data queued on the socket on each step, the copy is cheap
+// since it comes straight from the mapping
+static const qint64 chunkSize = 256 * 1024;
+
+// size of the window that the kernel is asked to load ahead of the cursor
+static const qint64 readaheadWindow = 4 * 1024 * 1024;
+
+QMutex MappedFile::m_mutex;
+QHash<QString, MappedFile *> MappedFile::m_files;
+
+MappedFile::MappedFile(const QString &path) :
+    m_file(path), m_data(NULL), m_size(0), m_refs(1)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if(m_data)
+        m_file.unmap(m_data);
+}
+
+/**
+ * @brief MappedFile::acquire
+ * Returns the shared mapping of a file, the mapping is replaced when the
+ * file grew past the mapped size (e.g. a package still being downloaded)
+ * @param path file to map
+ * @param minSize number of bytes that must be covered by the mapping
+ * @return the mapping, or NULL if the file cannot be mapped
+ */
+MappedFile *MappedFile::acquire(const QString &path, qint64 minSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    MappedFile *mapping = m_files.value(path);
+
+    if(mapping && mapping->m_size >= minSize)
+    {
+        mapping->m_refs++;
+        return mapping;
+    }
+
+    MappedFile *newMapping = new MappedFile(path);
+
+    if(newMapping->m_file.open(QIODevice::ReadOnly))
+    {
+        newMapping->m_size = newMapping->m_file.size();
+
+        if(newMapping->m_size > 0 && newMapping->m_size >= minSize)
+            newMapping->m_data = newMapping->m_file.map(0, newMapping->m_size);
+    }
+
+    if(newMapping->m_data == NULL)
+    {
+        qDebug() << "Cannot map" << path << ":" << newMapping->m_file.errorString();
+        delete newMapping;
+        return NULL;
+    }
+
+#ifdef Q_OS_UNIX
+    madvise(newMapping->m_data, newMapping->m_size, MADV_SEQUENTIAL);
+#endif
+
+    // the old mapping stays alive until the senders using it let it go
+    m_files.insert(path, newMapping);
+    return newMapping;
+}
+
+/**
+ * @brief MappedFile::release
+ * Drops a reference, the file is unmapped once nobody uses it
+ */
+void MappedFile::release()
+{
+    QMutexLocker locker(&m_mutex);
+
+    if(--m_refs > 0)
+        return;
+
+    QString path = m_file.fileName();
+
+    if(m_files.value(path) == this)
+        m_files.remove(path);
+
+    delete this;
+}
+
+const char *MappedFile::data() const
+{
+    return reinterpret_cast<const char *>(m_data);
+}
+
+qint64 MappedFile::size() const
+{
+    return m_size;
+}
+
+/**
+ * @brief MappedFile::willNeed
+ * Hint the kernel to start reading a region of the file in the background
+ */
+void MappedFile::willNeed(qint64 offset, qint64 length)
+{
+#ifdef Q_OS_UNIX
+    if(offset >= m_size)
+        return;
+
+    // madvise needs a page aligned address
+    static const qint64 pageSize = sysconf(_SC_PAGESIZE);
+    qint64 start = offset - offset % pageSize;
+    qint64 end = qMin(offset + length, m_size);
+
+    madvise(m_data + start, end - start, MADV_WILLNEED);
+#else
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+#endif
+}
+
+MmapFileSender::MmapFileSender(QTcpSocket *socket, QFile *file, QObject *parent) :
+    FileSender(socket, file, parent), m_mapping(NULL), m_adviseEnd(0), m_fallback(false)
+{
+}
+
+MmapFileSender::~MmapFileSender()
+{
+    if(m_mapping)
+        m_mapping->release();
+}
+
+/**
+ * @brief MmapFileSender::mapFile
+ * Make sure the mapping covers the range left to send
+ */
+bool MmapFileSender::mapFile()
+{
+    qint64 end = m_offset + m_remaining;
+
+    if(m_mapping && m_mapping->size() >= end)
+        return true;
+
+    if(m_mapping)
+        m_mapping->release();
+
+    m_mapping = MappedFile::acquire(m_file->fileName(), end);
+    m_adviseEnd = m_offset;
+
+    return m_mapping != NULL;
+}
+
+/**
+ * @brief MmapFileSender::transfer
+ * Queue the next chunk from the mapping, only when the previous chunk was
+ * already written
+ */
+void MmapFileSender::transfer()
+{
+    if(m_fallback)
+    {
+        FileSender::transfer();
+        return;
+    }
+
+    if(!m_active || m_socket->bytesToWrite() >= chunkSize)
+        return;
+
+    if(m_remaining == 0)
+    {
+        complete();
+        return;
+    }
+
+    if(!mapFile())
+    {
+        if(m_sent > 0)
+        {
+            fail();
+            return;
+        }
+
+        qDebug() << "mmap not available, using buffered transfer";
+        m_fallback = true;
+        FileSender::transfer();
+        return;
+    }
+
+    // keep the next window loading while the current one is being sent
+    if(m_adviseEnd < m_offset + readaheadWindow / 2)
+    {
+        qint64 start = qMax(m_adviseEnd, m_offset);
+        m_mapping->willNeed(start, readaheadWindow);
+        m_adviseEnd = start + readaheadWindow;
+    }
+
+    // the timer calls transfer again once the limiter allows more data
+    qint64 length = BandwidthLimiter::instance()->request(BandwidthLimiter::Lan, qMin(m_remaining, chunkSize), &m_throttle);
+    if(length == 0)
+        return;
+
+    if(m_socket->write(m_mapping->data() + m_offset, length) != length)
+    {
+        fail();
+        return;
+    }
+
+    m_offset += length;
+    m_remaining -= length;
+    m_sent += length;
+
+    if(m_remaining == 0)
+        complete();
+}
@@ -0,0 +1,79 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MMAPFILESENDER_H
+#define MMAPFILESENDER_H
+
+#include "filesender.h"
+
+#include <QHash>
+#include <QMutex>
+
+/**
+ * Read only memory mapping of a package file, shared by every connection
+ * serving the same file so the pages are mapped once and come straight
+ * from the page cache.
+ */
+class MappedFile
+{
+public:
+    static MappedFile *acquire(const QString &path, qint64 minSize);
+    void release();
+
+    const char *data() const;
+    qint64 size() const;
+    void willNeed(qint64 offset, qint64 length);
+
+private:
+    explicit MappedFile(const QString &path);
+    ~MappedFile();
+
+    QFile m_file;
+    uchar *m_data;
+    qint64 m_size;
+    int m_refs;
+
+    static QMutex m_mutex;
+    static QHash<QString, MappedFile *> m_files;
+};
+
+/**
+ * Sender that writes the data to the socket directly from a shared memory
+ * mapping of the file, asking the kernel to read ahead of the cursor.
+ */
+class MmapFileSender : public FileSender
+{
+    Q_OBJECT
+public:
+    explicit MmapFileSender(QTcpSocket *socket, QFile *file, QObject *parent = 0);
+    ~MmapFileSender();
+
+protected slots:
+    void transfer();
+
+private:
+    bool mapFile();
+
+    MappedFile *m_mapping;
+    qint64 m_adviseEnd;
+    bool m_fallback;
+};
+
+#endif // MMAPFILESENDER_H
@@ -0,0 +1,135 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packageevictor.h"
+#include "packageindex.h"
+
+#include <QDateTime>
+#include <QDebug>
+
+#include <algorithm>
+#include <limits>
+
+// the eviction frees some extra space, so it doesn't run again after
+// every download
+static const int targetPercent = 90;
+
+QAtomicInt PackageEvictor::m_running;
+
+class EvictionCandidate
+{
+public:
+    QString name;
+    qint64 size;
+    double score;
+
+    bool operator<(const EvictionCandidate &other) const
+    {
+        // higher score first
+        return score > other.score;
+    }
+};
+
+PackageEvictor::PackageEvictor(qint64 quota, bool weighted) :
+    m_quota(quota), m_weighted(weighted)
+{
+    setAutoDelete(true);
+}
+
+PackageEvictor::~PackageEvictor()
+{
+    m_running.fetchAndStoreOrdered(0);
+}
+
+/**
+ * @brief PackageEvictor::start
+ * @return true if no eviction is running, the caller must start one
+ */
+bool PackageEvictor::start()
+{
+    return m_running.testAndSetOrdered(0, 1);
+}
+
+void PackageEvictor::run()
+{
+    PackageIndex *index = PackageIndex::instance();
+    QList<PackageEntry> entries = index->entries();
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 usage = 0;
+
+    QList<EvictionCandidate> candidates;
+
+    foreach(const PackageEntry &entry, entries)
+    {
+        qint64 present = entry.ranges.presentBytes();
+        usage += present;
+
+        // packages in use are pinned
+        if(entry.serving || entry.writing)
+            continue;
+
+        EvictionCandidate candidate;
+        candidate.name = entry.name;
+        candidate.size = present;
+
+        // seconds since the last time the package was served
+        double age = qMax(now - entry.lastAccess, Q_INT64_C(0)) / 1000.0;
+
+        if(entry.integrity == PackageEntry::Corrupted)
+        {
+            // useless, removed before anything else
+            candidate.score = std::numeric_limits<double>::max();
+        }
+        else if(m_weighted)
+        {
+            // popular packages are kept longer, big ones are evicted
+            // sooner since they free more space at once
+            double gigabytes = present / (1024.0 * 1024.0 * 1024.0);
+            candidate.score = age * (1.0 + gigabytes) / (1.0 + entry.hits);
+        }
+        else
+        {
+            candidate.score = age;
+        }
+
+        candidates << candidate;
+    }
+
+    qint64 target = m_quota / 100 * targetPercent;
+    if(usage <= m_quota)
+        return;
+
+    std::sort(candidates.begin(), candidates.end());
+
+    foreach(const EvictionCandidate &candidate, candidates)
+    {
+        if(usage <= target)
+            break;
+
+        if(index->evict(candidate.name))
+        {
+            qDebug() << "Evicted" << candidate.name << "to free" << candidate.size << "bytes";
+            usage -= candidate.size;
+        }
+    }
+
+    if(usage > m_quota)
+        qWarning("The packages in use don't fit in the disk quota");
+}
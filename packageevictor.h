@@ -0,0 +1,49 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKAGEEVICTOR_H
+#define PACKAGEEVICTOR_H
+
+#include <QAtomicInt>
+#include <QRunnable>
+
+/**
+ * Background task that deletes the least valuable packages until the
+ * package directory fits in the disk quota. Only one task runs at a
+ * time, see start().
+ */
+class PackageEvictor : public QRunnable
+{
+public:
+    PackageEvictor(qint64 quota, bool weighted);
+    ~PackageEvictor();
+
+    static bool start();
+
+    void run();
+
+private:
+    qint64 m_quota;
+    bool m_weighted;
+
+    static QAtomicInt m_running;
+};
+
+#endif // PACKAGEEVICTOR_H
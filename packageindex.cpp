@@ -0,0 +1,1100 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packageindex.h"
+#include "downloaditem.h"
+#include "packageevictor.h"
+#include "packagepromoter.h"
+#include "packageverifier.h"
+#include "resumejournal.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSettings>
+#include <QThreadPool>
+
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// changes are applied in batches, a download in progress modifies the
+// file many times per second
+static const int coalesceDelay = 200;
+
+// the metadata is written at most once on this interval
+static const int saveDelay = 5000;
+
+// interval of the disk quota and storage tier checks
+static const int quotaInterval = 60 * 1000;
+
+// copies on the fast tier that weren't served for this long are dropped
+static const qint64 coldAge = Q_INT64_C(7) * 24 * 60 * 60 * 1000;
+
+// metadata of the packages, stored on the package directory
+static const QString metadataFile(".index");
+static const quint32 metadataVersion = 3;
+
+PackageIndex::PackageIndex(QObject *parent) :
+    QObject(parent), m_metadataChanged(false), m_rescan(false), m_fastQuota(0), m_promotionHits(0), m_quota(0), m_weighted(false), m_inotify(-1), m_watch(-1), m_notifier(NULL), m_watcher(NULL)
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(processChanges()));
+
+    m_saveTimer.setSingleShot(true);
+    connect(&m_saveTimer, SIGNAL(timeout()), this, SLOT(saveMetadata()));
+
+    connect(&m_quotaTimer, SIGNAL(timeout()), this, SLOT(checkQuota()));
+    connect(&m_quotaTimer, SIGNAL(timeout()), this, SLOT(checkTiers()));
+    m_quotaTimer.start(quotaInterval);
+
+    // hashing and copying are limited by the disk, one package at a time
+    // leaves the bandwidth to the proxy
+    m_verifyPool.setMaxThreadCount(1);
+    m_tierPool.setMaxThreadCount(1);
+
+#ifdef Q_OS_LINUX
+    m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_inotify != -1)
+    {
+        m_notifier = new QSocketNotifier(m_inotify, QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readEvents()));
+    }
+#endif
+
+    // no inotify, only the directory listing is watched
+    if(m_inotify == -1)
+    {
+        m_watcher = new QFileSystemWatcher(this);
+        connect(m_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(directoryChanged()));
+    }
+
+    setDirectory(DownloadItem::getPackageDir());
+    loadSettings();
+}
+
+PackageIndex::~PackageIndex()
+{
+    PackageVerifier::abortAll();
+    PackagePromoter::abortAll();
+    m_verifyPool.clear();
+    m_tierPool.clear();
+    m_verifyPool.waitForDone();
+    m_tierPool.waitForDone();
+    saveMetadata();
+
+#ifdef Q_OS_LINUX
+    if(m_inotify != -1)
+        ::close(m_inotify);
+#endif
+}
+
+/**
+ * @brief PackageIndex::instance
+ * The first call must be done from the main thread
+ * @return the shared index
+ */
+PackageIndex *PackageIndex::instance()
+{
+    static PackageIndex *index = new PackageIndex(QCoreApplication::instance());
+    return index;
+}
+
+QString PackageIndex::directory() const
+{
+    QReadLocker locker(&m_lock);
+    return m_directory;
+}
+
+/**
+ * @brief PackageIndex::sharesDirectory
+ * @return true if both directories are the same or one is inside the
+ * other, after resolving the links
+ */
+bool PackageIndex::sharesDirectory(const QString &first, const QString &second)
+{
+    QFileInfo firstInfo(first);
+    QFileInfo secondInfo(second);
+    QString a = firstInfo.canonicalFilePath().isEmpty() ? QDir::cleanPath(firstInfo.absoluteFilePath()) : firstInfo.canonicalFilePath();
+    QString b = secondInfo.canonicalFilePath().isEmpty() ? QDir::cleanPath(secondInfo.absoluteFilePath()) : secondInfo.canonicalFilePath();
+
+    return a == b || a.startsWith(b + '/') || b.startsWith(a + '/');
+}
+
+QString PackageIndex::filePath(const QString &name) const
+{
+    QReadLocker locker(&m_lock);
+    return m_directory + QDir::separator() + name;
+}
+
+/**
+ * @brief PackageIndex::servePath
+ * @return the copy of the package on the fast tier if there is one, the
+ * file on the package directory otherwise
+ */
+QString PackageIndex::servePath(const PackageEntry &entry) const
+{
+    QReadLocker locker(&m_lock);
+
+    if(entry.fast && !m_fastDirectory.isEmpty())
+        return m_fastDirectory + QDir::separator() + entry.name;
+    return m_directory + QDir::separator() + entry.name;
+}
+
+/**
+ * @brief PackageIndex::find
+ * @param name file name of the package
+ * @param entry filled with the file information if found
+ * @return true if the file exists on the package directory
+ */
+bool PackageIndex::find(const QString &name, PackageEntry &entry) const
+{
+    QReadLocker locker(&m_lock);
+    QHash<QString, PackageEntry>::const_iterator it = m_entries.find(name);
+
+    if(it == m_entries.end())
+        return false;
+
+    entry = it.value();
+    fillEntry(entry);
+    return true;
+}
+
+/**
+ * @brief PackageIndex::acquire
+ * Find a file that is going to be served and pin it, so it can't be
+ * evicted until release() is called
+ * @return true if the file exists on the package directory
+ */
+bool PackageIndex::acquire(const QString &name, PackageEntry &entry)
+{
+    QWriteLocker locker(&m_lock);
+    QHash<QString, PackageEntry>::iterator it = m_entries.find(name);
+
+    if(it == m_entries.end())
+        return false;
+
+    PackageMetadata &metadata = m_metadata[name];
+    metadata.lastAccess = QDateTime::currentMSecsSinceEpoch();
+    metadata.hits++;
+    m_readers[name]++;
+    markChanged();
+
+    entry = it.value();
+    fillEntry(entry);
+
+    if(!m_fastDirectory.isEmpty() && !entry.fast && entry.hits >= m_promotionHits)
+        QMetaObject::invokeMethod(this, "promote", Qt::QueuedConnection, Q_ARG(QString, name));
+
+    return true;
+}
+
+void PackageIndex::release(const QString &name)
+{
+    QWriteLocker locker(&m_lock);
+
+    if(--m_readers[name] <= 0)
+        m_readers.remove(name);
+}
+
+/**
+ * @brief PackageIndex::evict
+ * Delete a package to free disk space, unless it is being served or
+ * written
+ * @return true if the file was removed
+ */
+bool PackageIndex::evict(const QString &name)
+{
+    QString path;
+
+    {
+        QWriteLocker locker(&m_lock);
+
+        if(m_readers.contains(name) || m_writers.contains(name) || !m_entries.contains(name))
+            return false;
+
+        m_entries.remove(name);
+        removeMetadata(name);
+        path = m_directory + QDir::separator() + name;
+    }
+
+    if(!QMetaObject::invokeMethod(this, "demote", Qt::QueuedConnection, Q_ARG(QString, name)))
+        qWarning("Cannot remove %s from the fast storage", qPrintable(name));
+    return QFile::remove(path);
+}
+
+/**
+ * @brief PackageIndex::entries
+ * @return a copy of all the entries
+ */
+QList<PackageEntry> PackageIndex::entries() const
+{
+    QReadLocker locker(&m_lock);
+    QList<PackageEntry> list;
+
+    foreach(PackageEntry entry, m_entries)
+    {
+        fillEntry(entry);
+        list << entry;
+    }
+    return list;
+}
+
+/**
+ * @brief PackageIndex::diskUsage
+ * @return bytes stored on the package directory, the holes of the
+ * partial packages are not counted
+ */
+qint64 PackageIndex::diskUsage() const
+{
+    QReadLocker locker(&m_lock);
+    qint64 total = 0;
+
+    foreach(const PackageEntry &entry, m_entries)
+    {
+        QHash<QString, PackageMetadata>::const_iterator it = m_metadata.find(entry.name);
+
+        if(it != m_metadata.end() && it->partial)
+        {
+            RangeMap ranges = it->ranges;
+            ranges.truncate(entry.size);
+            total += ranges.presentBytes();
+        }
+        else
+        {
+            total += entry.size;
+        }
+    }
+    return total;
+}
+
+/**
+ * @brief PackageIndex::fillEntry
+ * Complete the file information with the metadata of the package, must be
+ * called with the lock held
+ */
+void PackageIndex::fillEntry(PackageEntry &entry) const
+{
+    PackageMetadata metadata = m_metadata.value(entry.name);
+
+    entry.expectedSize = metadata.expectedSize > 0 ? metadata.expectedSize : m_expected.value(entry.name, 0);
+    entry.url = metadata.url;
+    entry.etag = metadata.etag;
+    entry.lastModified = metadata.lastModified;
+    entry.lastAccess = metadata.lastAccess > 0 ? metadata.lastAccess : entry.modified;
+    entry.hits = metadata.hits;
+    entry.writing = m_writers.value(entry.name, 0) > 0;
+    entry.serving = m_readers.value(entry.name, 0) > 0;
+
+    if(metadata.partial)
+    {
+        entry.ranges = metadata.ranges;
+        entry.ranges.truncate(entry.size);
+    }
+    else
+    {
+        entry.ranges = RangeMap(entry.size);
+    }
+
+    // the result is only valid for the version of the file that was read
+    entry.integrity = metadata.verifiedTime == entry.modified ? PackageEntry::Integrity(metadata.integrity) : PackageEntry::Unchecked;
+
+    // the copy is outdated as soon as the package is written
+    entry.fast = m_fast.value(entry.name, -1) == entry.modified && !entry.writing && !metadata.partial;
+}
+
+/**
+ * @brief PackageIndex::removeMetadata
+ * Must be called with the lock held
+ */
+void PackageIndex::removeMetadata(const QString &name)
+{
+    if(m_metadata.remove(name) > 0)
+        markChanged();
+}
+
+/**
+ * @brief PackageIndex::startVerify
+ * Queue the verification of a package that is complete and isn't being
+ * written
+ */
+void PackageIndex::startVerify(const QString &name)
+{
+    PackageEntry entry;
+
+    if(m_verifying.contains(name) || !find(name, entry))
+        return;
+
+    if(entry.integrity != PackageEntry::Unchecked || entry.writing || entry.size <= 0)
+        return;
+
+    if(!entry.ranges.contains(ByteRange(0, entry.size - 1)) || (entry.expectedSize > 0 && entry.expectedSize != entry.size))
+        return;
+
+    m_verifying.insert(name);
+    m_verifyPool.start(new PackageVerifier(name, filePath(name), entry.modified));
+}
+
+/**
+ * @brief PackageIndex::setIntegrity
+ * Store the result of a verification
+ * @param modified modification time of the file that was verified
+ */
+void PackageIndex::setIntegrity(const QString &name, qint64 modified, int integrity)
+{
+    m_verifying.remove(name);
+
+    QWriteLocker locker(&m_lock);
+    QHash<QString, PackageEntry>::const_iterator it = m_entries.find(name);
+
+    if(it == m_entries.end())
+        return;
+
+    // the file was replaced while it was read
+    if(it->modified != modified)
+    {
+        locker.unlock();
+        startVerify(name);
+        return;
+    }
+
+    if(integrity == PackageEntry::Unchecked)
+        return;
+
+    PackageMetadata &metadata = m_metadata[name];
+    metadata.verifiedTime = modified;
+    metadata.integrity = integrity;
+    markChanged();
+    locker.unlock();
+
+    if(integrity == PackageEntry::Corrupted)
+        qWarning("%s is corrupted and won't be served", qPrintable(name));
+
+    emit packageChanged(name);
+}
+
+void PackageIndex::loadSettings()
+{
+    QSettings settings;
+    m_quota = settings.value("cacheQuota", 0).toLongLong() * 1024 * 1024 * 1024;
+    m_weighted = settings.value("evictionWeighted", false).toBool();
+    m_fastQuota = settings.value("fastStorageQuota", 64).toLongLong() * 1024 * 1024 * 1024;
+    m_promotionHits = settings.value("promotionHits", 3).toInt();
+    setFastDirectory(settings.value("fastStoragePath").toString());
+    checkQuota();
+    checkTiers();
+}
+
+/**
+ * @brief PackageIndex::setFastDirectory
+ * Use a new directory for the fast tier, the copies already there are
+ * used if they match the packages
+ */
+void PackageIndex::setFastDirectory(const QString &path)
+{
+    QString dir = path.isEmpty() ? QString() : QDir(path).absolutePath();
+
+    // the copies would be the packages themselves, dropping one would
+    // delete the only copy
+    if(!dir.isEmpty() && sharesDirectory(dir, directory()))
+    {
+        qWarning("The fast storage %s overlaps the package directory, it won't be used", qPrintable(dir));
+        dir.clear();
+    }
+
+    if(dir == m_fastDirectory)
+        return;
+
+    QHash<QString, qint64> fast;
+
+    if(!dir.isEmpty())
+    {
+        QDir::root().mkpath(dir);
+
+        QDir fastDir(dir);
+        fastDir.setFilter(QDir::Files | QDir::Hidden);
+
+        foreach(const QFileInfo &info, fastDir.entryInfoList())
+        {
+            // copies interrupted by a shutdown
+            if(info.fileName().startsWith('.') && info.fileName().endsWith(".part"))
+            {
+                QFile::remove(info.absoluteFilePath());
+                continue;
+            }
+
+            PackageEntry entry;
+            if(!find(info.fileName(), entry))
+                continue;
+
+            if(entry.size == info.size() && info.lastModified().toMSecsSinceEpoch() >= entry.modified)
+                fast.insert(entry.name, entry.modified);
+            else
+                removeFastCopy(info.absoluteFilePath(), entry.name);
+        }
+
+        qDebug() << "Fast storage:" << fast.size() << "packages in" << dir;
+    }
+
+    QWriteLocker locker(&m_lock);
+    m_fastDirectory = dir;
+    m_fast.swap(fast);
+}
+
+/**
+ * @brief PackageIndex::promote
+ * Copy a popular package to the fast tier, making room for it by dropping
+ * the copies served least recently
+ */
+void PackageIndex::promote(const QString &name)
+{
+    PackageEntry entry;
+
+    if(m_fastDirectory.isEmpty() || m_promoting.contains(name) || !find(name, entry) || entry.fast)
+        return;
+
+    if(entry.writing || entry.integrity == PackageEntry::Corrupted || entry.size <= 0 || entry.size > m_fastQuota)
+        return;
+
+    if(!entry.ranges.contains(ByteRange(0, entry.size - 1)) || (entry.expectedSize > 0 && entry.expectedSize != entry.size))
+        return;
+
+    qint64 usage = 0;
+    foreach(qint64 size, m_promoting)
+        usage += size;
+
+    QList<PackageEntry> copies;
+    foreach(const PackageEntry &other, entries())
+    {
+        if(other.fast)
+        {
+            usage += other.size;
+            copies << other;
+        }
+    }
+
+    while(usage + entry.size > m_fastQuota && !copies.isEmpty())
+    {
+        int coldest = 0;
+        for(int i = 1; i < copies.size(); i++)
+        {
+            if(copies.at(i).lastAccess < copies.at(coldest).lastAccess)
+                coldest = i;
+        }
+
+        // the package isn't popular enough to replace the others
+        if(copies.at(coldest).lastAccess >= entry.lastAccess)
+            return;
+
+        demote(copies.at(coldest).name);
+        usage -= copies.takeAt(coldest).size;
+    }
+
+    if(usage + entry.size > m_fastQuota)
+        return;
+
+    m_promoting.insert(name, entry.size);
+    m_tierPool.start(new PackagePromoter(name, filePath(name), m_fastDirectory + QDir::separator() + name, entry.modified));
+}
+
+/**
+ * @brief PackageIndex::promoted
+ * A copy to the fast tier finished
+ * @param modified modification time of the package that was copied
+ */
+void PackageIndex::promoted(const QString &name, qint64 modified, bool ok)
+{
+    m_promoting.remove(name);
+
+    QWriteLocker locker(&m_lock);
+    QHash<QString, PackageEntry>::const_iterator it = m_entries.find(name);
+
+    // the directory could have changed while the package was copied
+    if(ok && it != m_entries.end() && it->modified == modified && QFile::exists(m_fastDirectory + QDir::separator() + name))
+    {
+        m_fast.insert(name, modified);
+        return;
+    }
+
+    locker.unlock();
+    removeFastCopy(m_fastDirectory + QDir::separator() + name, name);
+}
+
+/**
+ * @brief PackageIndex::demote
+ * Drop the copy of a package from the fast tier, the connections serving
+ * it keep their open file
+ */
+void PackageIndex::demote(const QString &name)
+{
+    {
+        QWriteLocker locker(&m_lock);
+        if(m_fast.remove(name) == 0 || m_fastDirectory.isEmpty())
+            return;
+    }
+
+    qDebug() << "Removing" << name << "from the fast storage";
+    removeFastCopy(m_fastDirectory + QDir::separator() + name, name);
+}
+
+/**
+ * @brief PackageIndex::removeFastCopy
+ * Delete a copy from the fast tier, unless a link makes it the package
+ * itself
+ */
+void PackageIndex::removeFastCopy(const QString &path, const QString &name)
+{
+    QString copy = QFileInfo(path).canonicalFilePath();
+
+    if(!copy.isEmpty() && copy == QFileInfo(filePath(name)).canonicalFilePath())
+    {
+        qWarning("%s is the package itself, it won't be removed", qPrintable(path));
+        return;
+    }
+
+    QFile::remove(path);
+}
+
+/**
+ * @brief PackageIndex::checkTiers
+ * Drop the copies of the packages that went cold or were replaced
+ */
+void PackageIndex::checkTiers()
+{
+    QStringList stale;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    {
+        QReadLocker locker(&m_lock);
+
+        for(QHash<QString, qint64>::const_iterator it = m_fast.begin(); it != m_fast.end(); ++it)
+        {
+            QHash<QString, PackageEntry>::const_iterator entry = m_entries.find(it.key());
+
+            if(entry == m_entries.end() || entry->modified != it.value() ||
+                    now - m_metadata.value(it.key()).lastAccess > coldAge)
+                stale << it.key();
+        }
+    }
+
+    foreach(const QString &name, stale)
+        demote(name);
+}
+
+/**
+ * @brief PackageIndex::checkQuota
+ * Start the eviction in the background if the packages use more space
+ * than allowed
+ */
+void PackageIndex::checkQuota()
+{
+    if(m_quota <= 0 || diskUsage() <= m_quota)
+        return;
+
+    if(PackageEvictor::start())
+        QThreadPool::globalInstance()->start(new PackageEvictor(m_quota, m_weighted));
+}
+
+/**
+ * @brief PackageIndex::setExpectedSize
+ * Record the size announced by the store, used to tell apart the complete
+ * packages from the partial downloads
+ */
+void PackageIndex::setExpectedSize(const QString &name, qint64 size)
+{
+    QWriteLocker locker(&m_lock);
+    m_expected.insert(name, size);
+
+    // only the packages on disk are saved
+    if(m_entries.contains(name) && m_metadata.value(name).expectedSize != size)
+    {
+        m_metadata[name].expectedSize = size;
+        markChanged();
+    }
+}
+
+/**
+ * @brief PackageIndex::setOrigin
+ * Record where a package was downloaded from, the validators tell if the
+ * stored data belongs to the same version of the package
+ */
+void PackageIndex::setOrigin(const QString &name, const QString &url, const QByteArray &etag, const QByteArray &lastModified)
+{
+    QWriteLocker locker(&m_lock);
+
+    if(!m_entries.contains(name))
+        return;
+
+    PackageMetadata &metadata = m_metadata[name];
+
+    if(metadata.url == url && metadata.etag == etag && metadata.lastModified == lastModified)
+        return;
+
+    metadata.url = url;
+    metadata.etag = etag;
+    metadata.lastModified = lastModified;
+    markChanged();
+}
+
+/**
+ * @brief PackageIndex::beginWrite
+ * Register a download writing to a file. Several downloads can write to
+ * the same package as long as the data is written on its position
+ */
+void PackageIndex::beginWrite(const QString &name)
+{
+    QWriteLocker locker(&m_lock);
+    bool started = false;
+    m_writers[name]++;
+
+    // the file is visible to the proxy before the first write
+    PackageEntry &entry = m_entries[name];
+    if(entry.name.isEmpty())
+        entry.name = name;
+
+    // the ranges are tracked while the file is written, the size of the
+    // file can include data that isn't added yet
+    PackageMetadata &metadata = m_metadata[name];
+    if(!metadata.partial)
+    {
+        metadata.partial = true;
+        metadata.ranges = RangeMap(entry.size);
+        started = true;
+    }
+
+    if(metadata.expectedSize <= 0)
+        metadata.expectedSize = m_expected.value(name, 0);
+    markChanged();
+    locker.unlock();
+
+    // the writers preallocate the file, a crash before the delayed save
+    // would leave a file of the right size that looks complete
+    if(started)
+        saveMetadata();
+}
+
+void PackageIndex::endWrite(const QString &name)
+{
+    QString path = filePath(name);
+    QWriteLocker locker(&m_lock);
+
+    if(--m_writers[name] <= 0)
+    {
+        m_writers.remove(name);
+        compactRanges(name);
+
+        // the journal is only needed to resume a partial package
+        if(!m_metadata.value(name).partial)
+            ResumeJournal::remove(path);
+    }
+
+    // the download could have filled the disk
+    QMetaObject::invokeMethod(this, "checkQuota", Qt::QueuedConnection);
+}
+
+/**
+ * @brief PackageIndex::addRange
+ * Mark data as present on a file, must be called once the data was
+ * written so the proxy can read it
+ */
+void PackageIndex::addRange(const QString &name, const ByteRange &range)
+{
+    QWriteLocker locker(&m_lock);
+    PackageEntry &entry = m_entries[name];
+
+    if(entry.name.isEmpty())
+        entry.name = name;
+
+    PackageMetadata &metadata = m_metadata[name];
+    if(!metadata.partial)
+    {
+        metadata.partial = true;
+        metadata.ranges = RangeMap(entry.size);
+    }
+
+    entry.size = qMax(entry.size, range.end + 1);
+    metadata.ranges.add(range);
+    if(metadata.expectedSize <= 0)
+        metadata.expectedSize = m_expected.value(name, 0);
+
+    if(!m_writers.contains(name))
+        compactRanges(name);
+
+    markChanged();
+}
+
+/**
+ * @brief PackageIndex::compactRanges
+ * A file without holes doesn't need a map, must be called with the lock
+ * held
+ */
+void PackageIndex::compactRanges(const QString &name)
+{
+    QHash<QString, PackageMetadata>::iterator it = m_metadata.find(name);
+
+    if(it == m_metadata.end() || !it->partial)
+        return;
+
+    qint64 size = m_entries.value(name).size;
+    const QList<ByteRange> &present = it->ranges.ranges();
+
+    if(size > 0 && present.size() == 1 && present.first().start == 0 && present.first().end + 1 >= size)
+    {
+        it->partial = false;
+        it->ranges.clear();
+        markChanged();
+    }
+}
+
+/**
+ * @brief PackageIndex::clearRanges
+ * The file is going to be overwritten, nothing on it is valid
+ */
+void PackageIndex::clearRanges(const QString &name)
+{
+    ResumeJournal::remove(filePath(name));
+
+    QWriteLocker locker(&m_lock);
+    PackageMetadata &metadata = m_metadata[name];
+
+    metadata.partial = true;
+    metadata.ranges.clear();
+    metadata.etag.clear();
+    metadata.lastModified.clear();
+    markChanged();
+}
+
+/**
+ * @brief PackageIndex::limitRanges
+ * Forget the data of a package that isn't in valid, used when the map
+ * claims data that didn't survive a crash. The package becomes partial
+ */
+void PackageIndex::limitRanges(const QString &name, const RangeMap &valid)
+{
+    QWriteLocker locker(&m_lock);
+    PackageMetadata &metadata = m_metadata[name];
+
+    // the metadata of the package can be older than the crash
+    if(!metadata.partial)
+    {
+        metadata.partial = true;
+        metadata.ranges = RangeMap(m_entries.value(name).size);
+    }
+
+    metadata.ranges = metadata.ranges.intersect(valid);
+    markChanged();
+}
+
+/**
+ * @brief PackageIndex::markChanged
+ * Must be called with the lock held, from any thread
+ */
+void PackageIndex::markChanged()
+{
+    if(!m_metadataChanged)
+    {
+        m_metadataChanged = true;
+        QMetaObject::invokeMethod(this, "scheduleSave", Qt::QueuedConnection);
+    }
+}
+
+void PackageIndex::scheduleSave()
+{
+    if(!m_saveTimer.isActive())
+        m_saveTimer.start(saveDelay);
+}
+
+void PackageIndex::saveMetadata()
+{
+    QMutexLocker saveLocker(&m_saveMutex);
+    QHash<QString, PackageMetadata> metadata;
+    QString path;
+
+    {
+        QWriteLocker locker(&m_lock);
+        if(!m_metadataChanged)
+            return;
+
+        metadata = m_metadata;
+        path = m_directory + QDir::separator() + metadataFile;
+        m_metadataChanged = false;
+    }
+
+    QSaveFile file(path);
+    if(!file.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "Cannot save the package metadata:" << file.errorString();
+        return;
+    }
+
+    QDataStream out(&file);
+    out << metadataVersion << metadata;
+    file.commit();
+}
+
+void PackageIndex::loadMetadata()
+{
+    QFile file(directory() + QDir::separator() + metadataFile);
+    QHash<QString, PackageMetadata> metadata;
+
+    if(file.open(QIODevice::ReadOnly))
+    {
+        QDataStream in(&file);
+        quint32 version;
+        in >> version;
+
+        if(version == metadataVersion)
+            in >> metadata;
+
+        if(in.status() != QDataStream::Ok || version != metadataVersion)
+        {
+            qWarning("Invalid metadata file, partial packages will be downloaded again");
+            metadata.clear();
+        }
+    }
+
+    QWriteLocker locker(&m_lock);
+    m_metadata.swap(metadata);
+}
+
+int PackageIndex::count() const
+{
+    QReadLocker locker(&m_lock);
+    return m_entries.size();
+}
+
+void PackageIndex::setDirectory(const QString &path)
+{
+    QString dir = QDir(path).absolutePath();
+
+    if(dir == directory())
+        return;
+
+    unwatchDirectory();
+    saveMetadata();
+
+    {
+        QWriteLocker locker(&m_lock);
+        m_directory = dir;
+    }
+
+    watchDirectory();
+    loadMetadata();
+    rescan();
+}
+
+void PackageIndex::watchDirectory()
+{
+    QDir::root().mkpath(m_directory);
+
+#ifdef Q_OS_LINUX
+    if(m_inotify != -1)
+    {
+        m_watch = inotify_add_watch(m_inotify, QFile::encodeName(m_directory).constData(),
+                                    IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE |
+                                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        if(m_watch == -1)
+            qWarning("Cannot watch %s", qPrintable(m_directory));
+        return;
+    }
+#endif
+
+    m_watcher->addPath(m_directory);
+}
+
+void PackageIndex::unwatchDirectory()
+{
+#ifdef Q_OS_LINUX
+    if(m_watch != -1)
+    {
+        inotify_rm_watch(m_inotify, m_watch);
+        m_watch = -1;
+    }
+#endif
+
+    if(m_watcher && !m_watcher->directories().isEmpty())
+        m_watcher->removePaths(m_watcher->directories());
+}
+
+/**
+ * @brief PackageIndex::rescan
+ * Rebuild the index from a single listing of the package directory
+ */
+void PackageIndex::rescan()
+{
+    QDir dir(directory());
+    dir.setFilter(QDir::Files);
+
+    QHash<QString, PackageEntry> entries;
+
+    foreach(const QFileInfo &info, dir.entryInfoList())
+    {
+        PackageEntry entry;
+        entry.name = info.fileName();
+        entry.size = info.size();
+        entry.modified = info.lastModified().toMSecsSinceEpoch();
+        entries.insert(entry.name, entry);
+    }
+
+    QWriteLocker locker(&m_lock);
+
+    // metadata of files removed while the application wasn't running
+    for(QHash<QString, PackageMetadata>::iterator it = m_metadata.begin(); it != m_metadata.end();)
+    {
+        if(!entries.contains(it.key()))
+        {
+            it = m_metadata.erase(it);
+            markChanged();
+        }
+        else
+            ++it;
+    }
+
+    m_entries.swap(entries);
+    m_changed.clear();
+    m_rescan = false;
+    int count = m_entries.size();
+    QList<QString> names = m_entries.keys();
+    locker.unlock();
+
+    qDebug() << "Package index:" << count << "files in" << dir.absolutePath();
+
+    foreach(const QString &name, names)
+        startVerify(name);
+}
+
+/**
+ * @brief PackageIndex::update
+ * Refresh a single file after the application changed it
+ */
+void PackageIndex::update(const QString &name)
+{
+    updateEntry(name);
+    emit packageChanged(name);
+}
+
+void PackageIndex::updateEntry(const QString &name)
+{
+    QFileInfo info(filePath(name));
+    QWriteLocker locker(&m_lock);
+
+    if(!info.isFile())
+    {
+        ResumeJournal::remove(info.filePath());
+        m_entries.remove(name);
+        removeMetadata(name);
+        return;
+    }
+
+    PackageEntry &entry = m_entries[name];
+    entry.name = name;
+    entry.size = info.size();
+    entry.modified = info.lastModified().toMSecsSinceEpoch();
+
+    // called from the writer threads too
+    QMetaObject::invokeMethod(this, "startVerify", Qt::QueuedConnection, Q_ARG(QString, name));
+}
+
+/**
+ * @brief PackageIndex::readEvents
+ * Collect the names of the files changed since the last batch
+ */
+void PackageIndex::readEvents()
+{
+#ifdef Q_OS_LINUX
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while((len = ::read(m_inotify, buffer, sizeof(buffer))) > 0)
+    {
+        for(char *ptr = buffer; ptr < buffer + len;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW)
+                m_rescan = true;
+            else if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                // the directory is gone, it is created again on the next scan
+                if(event->wd == m_watch)
+                {
+                    m_watch = -1;
+                    m_rescan = true;
+                }
+            }
+            else if(event->wd == m_watch && event->len > 0 && event->name[0] != '.')
+                m_changed.insert(QFile::decodeName(event->name));
+        }
+    }
+
+    if(!m_timer.isActive() && (m_rescan || !m_changed.isEmpty()))
+        m_timer.start(coalesceDelay);
+#endif
+}
+
+void PackageIndex::directoryChanged()
+{
+    m_rescan = true;
+
+    if(!m_timer.isActive())
+        m_timer.start(coalesceDelay);
+}
+
+void PackageIndex::processChanges()
+{
+    if(m_rescan)
+    {
+        // the watch is lost when the directory is removed
+        if(m_watch == -1 && m_watcher == NULL)
+            watchDirectory();
+
+        rescan();
+        emit packageChanged(QString());
+        return;
+    }
+
+    QSet<QString> changed;
+    changed.swap(m_changed);
+
+    foreach(const QString &name, changed)
+    {
+        updateEntry(name);
+        emit packageChanged(name);
+    }
+}
+
+QDataStream &operator<<(QDataStream &out, const PackageMetadata &metadata)
+{
+    return out << metadata.url << metadata.expectedSize << metadata.etag << metadata.lastModified
+               << metadata.partial << metadata.ranges << metadata.lastAccess << metadata.hits
+               << metadata.verifiedTime << metadata.integrity;
+}
+
+QDataStream &operator>>(QDataStream &in, PackageMetadata &metadata)
+{
+    return in >> metadata.url >> metadata.expectedSize >> metadata.etag >> metadata.lastModified
+              >> metadata.partial >> metadata.ranges >> metadata.lastAccess >> metadata.hits
+              >> metadata.verifiedTime >> metadata.integrity;
+}
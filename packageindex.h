@@ -0,0 +1,208 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKAGEINDEX_H
+#define PACKAGEINDEX_H
+
+#include "byterange.h"
+
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QThreadPool>
+#include <QTimer>
+
+class PackageEntry
+{
+public:
+    enum Integrity
+    {
+        Unchecked,
+        Valid,
+        // must not be served, the download failed or the disk is damaged
+        Corrupted
+    };
+
+    PackageEntry() : size(0), modified(0), expectedSize(0), lastAccess(0), hits(0), writing(false), serving(false), fast(false), integrity(Unchecked) {}
+
+    bool isComplete() const { return expectedSize > 0 && ranges.contains(ByteRange(0, expectedSize - 1)); }
+    bool isPartial() const { return expectedSize > 0 && !isComplete(); }
+
+    QString name;
+    qint64 size;
+    qint64 modified;
+    qint64 expectedSize;
+    qint64 lastAccess;
+    qint32 hits;
+    bool writing;
+    bool serving;
+    // a copy is stored on the fast tier
+    bool fast;
+    Integrity integrity;
+    // data present on the file, a file without holes has a single range
+    RangeMap ranges;
+    QString url;
+    QByteArray etag;
+    QByteArray lastModified;
+};
+
+/**
+ * Information about a stored package that can't be read from the file
+ * system, saved on the metadata file of the package directory
+ */
+class PackageMetadata
+{
+public:
+    PackageMetadata() : expectedSize(0), partial(false), lastAccess(0), hits(0), verifiedTime(-1), integrity(PackageEntry::Unchecked) {}
+
+    QString url;
+    qint64 expectedSize;
+    // validators sent by the store
+    QByteArray etag;
+    QByteArray lastModified;
+    // the ranges are only tracked for files with holes
+    bool partial;
+    RangeMap ranges;
+    qint64 lastAccess;
+    qint32 hits;
+    // modification time of the file when it was verified
+    qint64 verifiedTime;
+    qint32 integrity;
+};
+
+QDataStream &operator<<(QDataStream &out, const PackageMetadata &metadata);
+QDataStream &operator>>(QDataStream &in, PackageMetadata &metadata);
+
+/**
+ * Files of the package directory, indexed by file name. The directory is
+ * read once and then kept up to date with inotify on Linux, or with a
+ * QFileSystemWatcher on other platforms, so the lookups never touch the
+ * disk. The metadata of the packages is kept with it and saved on a
+ * single file of the directory. The index lives on the main thread and
+ * can be queried from any thread.
+ *
+ * An optional fast tier (e.g. a SSD) keeps copies of the packages served
+ * most often. The copies are made in the background and dropped when the
+ * package goes cold, the package directory is always the primary store.
+ */
+class PackageIndex : public QObject
+{
+    Q_OBJECT
+public:
+    static PackageIndex *instance();
+    static bool sharesDirectory(const QString &first, const QString &second);
+    ~PackageIndex();
+
+    QString directory() const;
+    QString filePath(const QString &name) const;
+    QString servePath(const PackageEntry &entry) const;
+    bool find(const QString &name, PackageEntry &entry) const;
+    bool acquire(const QString &name, PackageEntry &entry);
+    void release(const QString &name);
+    bool evict(const QString &name);
+    QList<PackageEntry> entries() const;
+    qint64 diskUsage() const;
+    void setExpectedSize(const QString &name, qint64 size);
+    void setOrigin(const QString &name, const QString &url, const QByteArray &etag, const QByteArray &lastModified);
+    void beginWrite(const QString &name);
+    void endWrite(const QString &name);
+    void addRange(const QString &name, const ByteRange &range);
+    void clearRanges(const QString &name);
+    void limitRanges(const QString &name, const RangeMap &valid);
+    int count() const;
+
+public slots:
+    void setDirectory(const QString &path);
+    void rescan();
+    void update(const QString &name);
+    void loadSettings();
+    void checkQuota();
+    void setIntegrity(const QString &name, qint64 modified, int integrity);
+    void checkTiers();
+    void promoted(const QString &name, qint64 modified, bool ok);
+
+signals:
+    void packageChanged(const QString &name);
+
+private slots:
+    void readEvents();
+    void directoryChanged();
+    void processChanges();
+    void scheduleSave();
+    void saveMetadata();
+    void startVerify(const QString &name);
+    void promote(const QString &name);
+    void demote(const QString &name);
+
+private:
+    explicit PackageIndex(QObject *parent = 0);
+
+    void watchDirectory();
+    void unwatchDirectory();
+    void updateEntry(const QString &name);
+    void loadMetadata();
+    void markChanged();
+    void fillEntry(PackageEntry &entry) const;
+    void removeMetadata(const QString &name);
+    void compactRanges(const QString &name);
+    void setFastDirectory(const QString &path);
+    void removeFastCopy(const QString &path, const QString &name);
+
+    mutable QReadWriteLock m_lock;
+    // file system information of the files
+    QHash<QString, PackageEntry> m_entries;
+    QHash<QString, PackageMetadata> m_metadata;
+    // sizes announced for packages that aren't stored yet
+    QHash<QString, qint64> m_expected;
+    QHash<QString, int> m_writers;
+    QHash<QString, int> m_readers;
+    bool m_metadataChanged;
+    QString m_directory;
+    QSet<QString> m_changed;
+    bool m_rescan;
+    QTimer m_timer;
+    QTimer m_saveTimer;
+    // a save from another thread can't overwrite a newer one
+    QMutex m_saveMutex;
+    QTimer m_quotaTimer;
+    QThreadPool m_verifyPool;
+    QSet<QString> m_verifying;
+    QString m_fastDirectory;
+    qint64 m_fastQuota;
+    int m_promotionHits;
+    // modification time of the packages copied on the fast tier
+    QHash<QString, qint64> m_fast;
+    // size of the copies in progress
+    QHash<QString, qint64> m_promoting;
+    QThreadPool m_tierPool;
+    qint64 m_quota;
+    bool m_weighted;
+    int m_inotify;
+    int m_watch;
+    QSocketNotifier *m_notifier;
+    QFileSystemWatcher *m_watcher;
+};
+
+#endif // PACKAGEINDEX_H
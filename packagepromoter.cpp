@@ -0,0 +1,107 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packagepromoter.h"
+#include "packageindex.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMetaObject>
+
+// amount of data copied on each step
+static const qint64 copySize = 1024 * 1024;
+
+QAtomicInt PackagePromoter::m_abort;
+
+PackagePromoter::PackagePromoter(const QString &name, const QString &source, const QString &target, qint64 modified) :
+    m_name(name), m_source(source), m_target(target), m_modified(modified)
+{
+    setAutoDelete(true);
+}
+
+/**
+ * @brief PackagePromoter::abortAll
+ * Make the running tasks give up, used on shutdown
+ */
+void PackagePromoter::abortAll()
+{
+    m_abort.fetchAndStoreOrdered(1);
+}
+
+void PackagePromoter::run()
+{
+    bool ok = copy();
+
+    if(m_abort.load())
+        return;
+
+    QMetaObject::invokeMethod(PackageIndex::instance(), "promoted", Qt::QueuedConnection,
+                              Q_ARG(QString, m_name), Q_ARG(qint64, m_modified), Q_ARG(bool, ok));
+}
+
+bool PackagePromoter::copy()
+{
+    QFileInfo info(m_target);
+    QString temp = info.absolutePath() + QDir::separator() + "." + info.fileName() + ".part";
+
+    QFile source(m_source);
+    QFile target(temp);
+
+    if(!source.open(QIODevice::ReadOnly) || !target.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "Cannot copy" << m_name << "to the fast storage:" << source.errorString() << target.errorString();
+        return false;
+    }
+
+    QByteArray buffer;
+
+    while(!source.atEnd())
+    {
+        buffer = source.read(copySize);
+
+        if(m_abort.load() || buffer.isEmpty() || target.write(buffer) != buffer.size())
+        {
+            target.remove();
+            return false;
+        }
+    }
+
+    target.close();
+
+    // the package was replaced while it was copied
+    if(QFileInfo(m_source).lastModified().toMSecsSinceEpoch() != m_modified || target.size() != source.size())
+    {
+        target.remove();
+        return false;
+    }
+
+    QFile::remove(m_target);
+    if(!QFile::rename(temp, m_target))
+    {
+        QFile::remove(temp);
+        return false;
+    }
+
+    qDebug() << "Copied" << m_name << "to the fast storage";
+    return true;
+}
@@ -0,0 +1,53 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKAGEPROMOTER_H
+#define PACKAGEPROMOTER_H
+
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QString>
+
+/**
+ * Background task that copies a popular package to the fast storage tier.
+ * The copy is written with a temporary name and renamed once complete,
+ * the result is reported to the PackageIndex.
+ */
+class PackagePromoter : public QRunnable
+{
+public:
+    PackagePromoter(const QString &name, const QString &source, const QString &target, qint64 modified);
+
+    static void abortAll();
+
+    void run();
+
+private:
+    bool copy();
+
+    QString m_name;
+    QString m_source;
+    QString m_target;
+    qint64 m_modified;
+
+    static QAtomicInt m_abort;
+};
+
+#endif // PACKAGEPROMOTER_H
@@ -0,0 +1,161 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packageverifier.h"
+#include "packageindex.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QMetaObject>
+#include <QRegularExpression>
+#include <QtEndian>
+
+// header magics, big endian
+static const quint32 pkgMagic = 0x7F504B47;   // "\x7FPKG", PS3/PSP/PSVita
+static const quint32 ps4PkgMagic = 0x7F434E54; // "\x7FCNT", PS4
+
+// PS3 header: total size of the package
+static const int pkgTotalSizeOffset = 0x18;
+// PS3 footer: SHA-1 of everything before it, padded to 32 bytes
+static const int pkgFooterSize = 0x20;
+// PS4 header: total size of the package
+static const int ps4PkgSizeOffset = 0x430;
+
+// amount of data hashed on each read
+static const qint64 readSize = 1024 * 1024;
+
+QAtomicInt PackageVerifier::m_abort;
+
+PackageVerifier::PackageVerifier(const QString &name, const QString &path, qint64 modified) :
+    m_name(name), m_path(path), m_modified(modified)
+{
+    setAutoDelete(true);
+}
+
+/**
+ * @brief PackageVerifier::abortAll
+ * Make the running tasks give up, used on shutdown so the application
+ * doesn't wait for a big package to be hashed
+ */
+void PackageVerifier::abortAll()
+{
+    m_abort.fetchAndStoreOrdered(1);
+}
+
+void PackageVerifier::run()
+{
+    int result = verify();
+
+    if(m_abort.load())
+        return;
+
+    // the file changed while it was read, the new version is checked
+    // once it is complete
+    if(QFileInfo(m_path).lastModified().toMSecsSinceEpoch() != m_modified)
+        result = PackageEntry::Unchecked;
+
+    QMetaObject::invokeMethod(PackageIndex::instance(), "setIntegrity", Qt::QueuedConnection,
+                              Q_ARG(QString, m_name), Q_ARG(qint64, m_modified), Q_ARG(int, result));
+}
+
+int PackageVerifier::verify()
+{
+    QFile file(m_path);
+
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Cannot verify" << m_name << ":" << file.errorString();
+        return PackageEntry::Unchecked;
+    }
+
+    qint64 size = file.size();
+    QByteArray header = file.read(ps4PkgSizeOffset + 8);
+
+    // not a package, nothing to check
+    if(header.size() < 4)
+        return PackageEntry::Valid;
+
+    const uchar *data = reinterpret_cast<const uchar *>(header.constData());
+    quint32 magic = qFromBigEndian<quint32>(data);
+
+    if(magic == ps4PkgMagic)
+    {
+        // the first piece of a split package has the size of the whole
+        // package, the pieces can't be checked on their own
+        QRegularExpression piece("_\\d+\\.pkg$", QRegularExpression::CaseInsensitiveOption);
+        bool whole = !piece.match(m_name).hasMatch();
+
+        if(header.size() < ps4PkgSizeOffset + 8)
+            return whole ? PackageEntry::Corrupted : PackageEntry::Unchecked;
+
+        quint64 total = qFromBigEndian<quint64>(data + ps4PkgSizeOffset);
+        if(total == quint64(size))
+            return PackageEntry::Valid;
+
+        if(!whole || quint64(size) < total)
+            return PackageEntry::Unchecked;
+
+        qDebug() << "Size mismatch on" << m_name;
+        return PackageEntry::Corrupted;
+    }
+
+    if(magic != pkgMagic)
+        return PackageEntry::Valid;
+
+    if(header.size() < pkgTotalSizeOffset + 8 || size < pkgFooterSize ||
+            qFromBigEndian<quint64>(data + pkgTotalSizeOffset) != quint64(size))
+    {
+        qDebug() << "Size mismatch on" << m_name;
+        return PackageEntry::Corrupted;
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    qint64 remaining = size - pkgFooterSize;
+    QByteArray buffer;
+
+    file.seek(0);
+
+    while(remaining > 0)
+    {
+        if(m_abort.load())
+            return PackageEntry::Unchecked;
+
+        buffer = file.read(qMin(remaining, readSize));
+        if(buffer.isEmpty())
+            return PackageEntry::Unchecked;
+
+        hash.addData(buffer);
+        remaining -= buffer.size();
+    }
+
+    QByteArray digest = hash.result();
+
+    if(file.read(digest.size()) != digest)
+    {
+        qDebug() << "SHA-1 mismatch on" << m_name;
+        return PackageEntry::Corrupted;
+    }
+
+    qDebug() << "Package verified:" << m_name;
+    return PackageEntry::Valid;
+}
@@ -0,0 +1,53 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKAGEVERIFIER_H
+#define PACKAGEVERIFIER_H
+
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QString>
+
+/**
+ * Background task that checks a stored package against the information
+ * of its own header. PS3/PSP/PSVita packages carry a SHA-1 of the whole
+ * file on the last bytes, PS4 packages only allow a size check. The
+ * result is reported to the PackageIndex.
+ */
+class PackageVerifier : public QRunnable
+{
+public:
+    PackageVerifier(const QString &name, const QString &path, qint64 modified);
+
+    static void abortAll();
+
+    void run();
+
+private:
+    int verify();
+
+    QString m_name;
+    QString m_path;
+    qint64 m_modified;
+
+    static QAtomicInt m_abort;
+};
+
+#endif // PACKAGEVERIFIER_H
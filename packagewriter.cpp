@@ -0,0 +1,357 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packagewriter.h"
+#include "byterange.h"
+#include "diskwriter.h"
+#include "fetchregistry.h"
+#include "packageindex.h"
+
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// data gathered before it is written to disk
+static const qint64 flushSize = 4 * 1024 * 1024;
+
+// the writes end on a multiple of the block size of the file system
+static const qint64 blockSize = 4096;
+
+// milliseconds that the data can wait in memory before it is written
+static const int flushDelay = 1000;
+
+#ifdef Q_OS_UNIX
+// buffers written on each call, below the IOV_MAX of every system
+static const int maxVectors = 256;
+#endif
+
+PackageWriter::PackageWriter(const QString &name, const QString &path) :
+    QObject(0), m_name(name), m_file(path), m_journal(path), m_offset(0), m_pending(0), m_skip(0), m_failed(false),
+    m_flushTimer(this), m_written(0), m_writes(0), m_writeTime(0)
+{
+    m_flushTimer.setSingleShot(true);
+    connect(&m_flushTimer, SIGNAL(timeout()), this, SLOT(flushPending()));
+}
+
+PackageWriter::~PackageWriter()
+{
+    // the disk thread was stopped before the writer finished
+    if(m_file.isOpen())
+    {
+        flush();
+        m_journal.sync(&m_file);
+        m_file.close();
+    }
+}
+
+/**
+ * @brief PackageWriter::preallocate
+ * Reserve the disk space of the whole package at once, so the file isn't
+ * fragmented by the segments writing on different positions. The data
+ * already stored is kept. File systems without support get a sparse file
+ * @param file open package file
+ * @param size final size of the package
+ * @return false if the space cannot be reserved
+ */
+bool PackageWriter::preallocate(QFile *file, qint64 size)
+{
+#ifdef Q_OS_LINUX
+    if(::fallocate(file->handle(), 0, 0, size) == 0)
+        return true;
+
+    if(errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        qDebug() << "Cannot allocate " << size << " bytes for " << file->fileName() << ": " << qt_error_string(errno);
+        return false;
+    }
+#endif
+
+    return file->size() >= size || file->resize(size);
+}
+
+/**
+ * @brief PackageWriter::open
+ * Open the package file, called before the writer is moved to the disk
+ * thread
+ */
+bool PackageWriter::open()
+{
+    // unbuffered, the data is already gathered here
+    if(!m_file.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+    {
+        m_error = m_file.errorString();
+        return false;
+    }
+
+    // without a journal the data is downloaded again after a crash
+    m_journal.open();
+    return true;
+}
+
+QString PackageWriter::errorString() const
+{
+    return m_error;
+}
+
+/**
+ * @brief PackageWriter::write
+ * Queue data for the package file, called from the reader thread
+ * @param offset position of the data on the package
+ */
+void PackageWriter::write(qint64 offset, const QByteArray &data)
+{
+    if(data.isEmpty())
+        return;
+
+    DiskWriter::instance()->enqueue(data.size());
+    QMetaObject::invokeMethod(this, "writeData", Qt::QueuedConnection, Q_ARG(qint64, offset), Q_ARG(QByteArray, data));
+}
+
+/**
+ * @brief PackageWriter::finish
+ * No more data will be written, closed() is emitted once the queued
+ * data is on disk and the writer deletes itself
+ */
+void PackageWriter::finish()
+{
+    QMetaObject::invokeMethod(this, "closeFile", Qt::QueuedConnection);
+}
+
+/**
+ * @brief PackageWriter::writeData
+ * Gather the data, it is written once enough is gathered or when it
+ * waited for too long
+ */
+void PackageWriter::writeData(qint64 offset, const QByteArray &data)
+{
+    DiskWriter::instance()->dequeue(data.size());
+
+    if(m_failed)
+        return;
+
+    // the data is gathered while it is contiguous
+    if(m_pending > 0 && offset != m_offset + m_pending && !flush())
+        return;
+
+    if(m_pending == 0)
+    {
+        m_offset = offset;
+        m_flushTimer.start(flushDelay);
+    }
+
+    m_chunks << data;
+    m_pending += data.size();
+
+    if(m_pending < flushSize)
+        return;
+
+    // the tail before the next block boundary waits for more data
+    qint64 end = (m_offset + m_pending) / blockSize * blockSize;
+    if(end > m_offset)
+        flushTo(end);
+}
+
+void PackageWriter::flushPending()
+{
+    if(!m_failed)
+        flush();
+}
+
+void PackageWriter::closeFile()
+{
+    if(!m_failed)
+        flush();
+
+    m_journal.sync(&m_file);
+    m_file.close();
+
+    if(m_writes > 0)
+    {
+        double seconds = qMax(m_writeTime, Q_INT64_C(1)) / 1e9;
+        qDebug("Wrote %lld bytes of %s in %d writes, %.1f MiB/s", m_written, qPrintable(m_name), m_writes,
+               m_written / seconds / (1024 * 1024));
+    }
+
+    emit closed();
+    deleteLater();
+}
+
+/**
+ * @brief PackageWriter::flush
+ * Write all the gathered data
+ */
+bool PackageWriter::flush()
+{
+    m_flushTimer.stop();
+    return flushTo(m_offset + m_pending);
+}
+
+/**
+ * @brief PackageWriter::flushTo
+ * Write the queued data up to end, then add it to the range map
+ */
+bool PackageWriter::flushTo(qint64 end)
+{
+    qint64 start = m_offset;
+
+    if(end <= start)
+        return true;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // the chunks are consumed by the write, kept for the journal
+    QList<QByteArray> chunks = m_chunks;
+    int skip = m_skip;
+
+    // the data is dropped, the segment is downloaded again later
+    if(!writeChunks(end - start))
+    {
+        qDebug() << "Cannot write " << m_name << ": " << m_error;
+        m_journal.discard();
+        m_failed = true;
+        m_chunks.clear();
+        m_pending = 0;
+        m_skip = 0;
+        emit failed(m_error);
+        return false;
+    }
+
+    qint64 elapsed = timer.nsecsElapsed();
+    DiskWriter::instance()->recordFlush(end - start, elapsed);
+    m_writeTime += elapsed;
+    m_written += end - start;
+    ++m_writes;
+
+    qint64 offset = start;
+    foreach(const QByteArray &chunk, chunks)
+    {
+        qint64 size = qMin(qint64(chunk.size() - skip), end - offset);
+        m_journal.add(offset, chunk.constData() + skip, size);
+        offset += size;
+        skip = 0;
+
+        if(offset == end)
+            break;
+    }
+
+    if(m_journal.needsSync())
+        m_journal.sync(&m_file);
+
+    PackageIndex::instance()->addRange(m_name, ByteRange(start, end - 1));
+    FetchRegistry::instance()->notify(m_name);
+    return true;
+}
+
+#ifdef Q_OS_UNIX
+bool PackageWriter::writeChunks(qint64 length)
+{
+    while(length > 0)
+    {
+        struct iovec vectors[maxVectors];
+        qint64 batch = 0;
+        int count = 0;
+
+        for(int i = 0; i < m_chunks.size() && count < maxVectors && batch < length; ++i)
+        {
+            int skip = i == 0 ? m_skip : 0;
+            qint64 size = qMin(qint64(m_chunks[i].size() - skip), length - batch);
+
+            vectors[count].iov_base = const_cast<char *>(m_chunks[i].constData()) + skip;
+            vectors[count].iov_len = size;
+            batch += size;
+            ++count;
+        }
+
+        ssize_t written = ::pwritev(m_file.handle(), vectors, count, m_offset);
+
+        if(written < 0 && errno == EINTR)
+            continue;
+
+        if(written <= 0)
+        {
+            m_error = written < 0 ? qt_error_string(errno) : QString("nothing was written");
+            return false;
+        }
+
+        consume(written);
+        length -= written;
+    }
+
+    return true;
+}
+#else
+bool PackageWriter::writeChunks(qint64 length)
+{
+    if(!m_file.seek(m_offset))
+    {
+        m_error = m_file.errorString();
+        return false;
+    }
+
+    while(length > 0)
+    {
+        const QByteArray &chunk = m_chunks.first();
+        qint64 size = qMin(qint64(chunk.size() - m_skip), length);
+        qint64 written = m_file.write(chunk.constData() + m_skip, size);
+
+        if(written <= 0)
+        {
+            m_error = m_file.errorString();
+            return false;
+        }
+
+        consume(written);
+        length -= written;
+    }
+
+    return true;
+}
+#endif
+
+/**
+ * @brief PackageWriter::consume
+ * Drop the data that was written from the front of the queue
+ */
+void PackageWriter::consume(qint64 length)
+{
+    m_offset += length;
+    m_pending -= length;
+
+    while(length > 0)
+    {
+        qint64 left = m_chunks.first().size() - m_skip;
+
+        if(length < left)
+        {
+            m_skip += length;
+            return;
+        }
+
+        length -= left;
+        m_chunks.removeFirst();
+        m_skip = 0;
+    }
+}
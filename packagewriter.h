@@ -0,0 +1,88 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKAGEWRITER_H
+#define PACKAGEWRITER_H
+
+#include "resumejournal.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QObject>
+#include <QTimer>
+
+/**
+ * Writes the data of a download on its position of the package file.
+ * The writer lives on the DiskWriter thread and receives the data as
+ * queued calls. The data is kept in memory until a few MiB are gathered
+ * and then written with a single call, ending on a block boundary so
+ * the next write starts aligned. The written ranges are added to the
+ * range map only once they are on disk, data that waits for too long is
+ * flushed so the proxy can serve it. The written blocks are recorded on
+ * the resume journal of the package.
+ */
+class PackageWriter : public QObject
+{
+    Q_OBJECT
+public:
+    PackageWriter(const QString &name, const QString &path);
+
+    static bool preallocate(QFile *file, qint64 size);
+
+    bool open();
+    QString errorString() const;
+    void write(qint64 offset, const QByteArray &data);
+    void finish();
+
+signals:
+    void failed(const QString &error);
+    void closed();
+
+private slots:
+    void writeData(qint64 offset, const QByteArray &data);
+    void flushPending();
+    void closeFile();
+
+private:
+    ~PackageWriter();
+
+    bool flush();
+    bool flushTo(qint64 end);
+    bool writeChunks(qint64 length);
+    void consume(qint64 length);
+
+    QString m_name;
+    QFile m_file;
+    ResumeJournal m_journal;
+    QList<QByteArray> m_chunks;
+    qint64 m_offset;
+    qint64 m_pending;
+    int m_skip;
+    bool m_failed;
+    QTimer m_flushTimer;
+    qint64 m_written;
+    int m_writes;
+    qint64 m_writeTime;
+    QString m_error;
+};
+
+#endif // PACKAGEWRITER_H
@@ -19,232 +19,1146 @@
  */
 
 #include "proxyconnection.h"
-#include "downloaditem.h"
+#include "bandwidthlimiter.h"
+#include "cachewriter.h"
+#include "diskwriter.h"
+#include "fetchregistry.h"
+#include "filesender.h"
+#include "hostcache.h"
+#include "packageindex.h"
+#include "proxyworker.h"
+#ifdef Q_OS_LINUX
+#include "splicetunnel.h"
+#endif
+#include "upstreampool.h"
+#include "utils.h"
 
+#include <QDateTime>
 #include <QDir>
 #include <QFileInfo>
+#include <QMutex>
 #include <QStandardPaths>
+#include <QUrl>
 
-static const QStringList methods = QStringList() << "GET" << "POST" << "HEAD" << "PUT" << "DELETE" << "TRACE" << "OPTIONS";
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
 
-ProxyConnection::ProxyConnection(QObject *parent) :
-    QTcpSocket(parent), m_notifier(NULL), m_target(NULL), m_file(NULL), m_end_range(-1)
+static const QList<QByteArray> methods = QList<QByteArray>() << "GET" << "POST" << "HEAD" << "PUT" << "DELETE" << "TRACE" << "OPTIONS";
+
+/**
+ * @brief parseContentRange
+ * parse a Content-Range header with the bytes first-last/total format
+ */
+static bool parseContentRange(const QByteArray &value, qint64 *first, qint64 *last, qint64 *total)
+{
+    QByteArray range = value.trimmed();
+    int dash = range.indexOf('-');
+    int slash = range.indexOf('/');
+    bool ok1, ok2, ok3;
+
+    if(!range.startsWith("bytes ") || dash == -1 || slash < dash)
+        return false;
+
+    *first = range.mid(6, dash - 6).trimmed().toLongLong(&ok1);
+    *last = range.mid(dash + 1, slash - dash - 1).trimmed().toLongLong(&ok2);
+    *total = range.mid(slash + 1).trimmed().toLongLong(&ok3);
+
+    return ok1 && ok2 && ok3 && *first <= *last && *last < *total;
+}
+
+// data held in memory by all the proxy connections
+static QMutex bufferedMutex;
+static qint64 bufferedTotal = 0;
+
+ProxyConnection::ProxyConnection(const ProxySettings *settings, QObject *parent) :
+    QTcpSocket(parent), m_settings(settings), m_parser(HttpParser::REQUEST), m_responseParser(HttpParser::RESPONSE),
+    m_sender(NULL), m_cacheWriter(NULL), m_target(NULL), m_targetPort(0), m_reusedTarget(false), m_tunnel(false), m_busy(false), m_keepAlive(false),
+    m_forwarding(false), m_responseStarted(false), m_revalidating(false), m_headRequest(false),
+    m_spliceEnabled(true),
+    m_file(NULL), m_fileSize(0), m_partialFile(false), m_fetchingGap(false), m_waitingFetch(false), m_spanStart(0), m_spanEnd(0),
+    m_gapStart(0), m_gapEnd(0), m_rangeIndex(0), m_reportedBuffered(0)
+{
+    // memory cap of the connection, split between the read buffers of both
+    // sockets and the data queued for writing on each direction
+    m_highWatermark = qMax(settings->bufferSize / 4, Q_INT64_C(16384));
+    m_lowWatermark = m_highWatermark / 4;
+    setReadBufferSize(m_highWatermark);
+
+    m_connectTimer.setSingleShot(true);
+    connect(&m_connectTimer, SIGNAL(timeout()), this, SLOT(targetTimeout()));
+
+    // both directions of the relay are paced by the WAN limit
+    m_uploadThrottle.setSingleShot(true);
+    m_downloadThrottle.setSingleShot(true);
+    connect(&m_uploadThrottle, SIGNAL(timeout()), this, SLOT(readProxyClient()));
+    connect(&m_downloadThrottle, SIGNAL(timeout()), this, SLOT(receiveData()));
+    connect(DiskWriter::instance(), SIGNAL(drained()), this, SLOT(receiveData()));
+    connect(this, SIGNAL(disconnected()), this, SLOT(closeFileConnection()));
+    connect(this, SIGNAL(bytesWritten(qint64)), this, SLOT(clientBytesWritten()));
+}
+
+ProxyConnection::~ProxyConnection()
+{
+    HostCache::instance()->cancel(this);
+    FetchRegistry::instance()->cancel(this);
+    stopCaching();
+
+    QMutexLocker locker(&bufferedMutex);
+    bufferedTotal -= m_reportedBuffered;
+}
+
+/**
+ * @brief ProxyConnection::readProxyClient
+ * Called when new data is available on the proxy to read
+ */
+void ProxyConnection::readProxyClient()
+{
+    // the remote server is slower than the client, the data stays on the
+    // socket until the queued data is written
+    if(upstreamBuffered() >= m_highWatermark)
+    {
+        updateBufferedBytes();
+        return;
+    }
+
+    BandwidthLimiter *limiter = BandwidthLimiter::instance();
+
+    // tunnels are relayed without looking at the data
+    if(m_tunnel)
+    {
+        sendToTarget(read(limiter->request(BandwidthLimiter::Wan, bytesAvailable(), &m_uploadThrottle)));
+        updateBufferedBytes();
+        startSplice();
+        return;
+    }
+
+    if(m_buffer.size() < m_highWatermark)
+    {
+        qint64 wanted = qMin(bytesAvailable(), m_highWatermark - m_buffer.size());
+
+        // only the data going to the remote server counts as upload
+        if(m_forwarding)
+            wanted = limiter->request(BandwidthLimiter::Wan, wanted, &m_uploadThrottle);
+
+        m_buffer.append(read(wanted));
+    }
+
+    processRequests();
+    updateBufferedBytes();
+}
+
+/**
+ * @brief ProxyConnection::clientBytesWritten
+ * resume reading from the remote server once the client caught up
+ */
+void ProxyConnection::clientBytesWritten()
+{
+    if(bytesToWrite() <= m_lowWatermark && m_target != NULL && m_target->bytesAvailable() > 0)
+        receiveData();
+
+    updateBufferedBytes();
+    startSplice();
+}
+
+/**
+ * @brief ProxyConnection::targetBytesWritten
+ * resume reading from the client once the remote server caught up
+ */
+void ProxyConnection::targetBytesWritten()
+{
+    if(upstreamBuffered() <= m_lowWatermark && bytesAvailable() > 0)
+        readProxyClient();
+
+    updateBufferedBytes();
+    startSplice();
+}
+
+qint64 ProxyConnection::upstreamBuffered() const
+{
+    return m_pending.size() + (m_target != NULL ? m_target->bytesToWrite() : 0);
+}
+
+/**
+ * @brief ProxyConnection::bufferedBytes
+ * @return data held in memory by this connection, in both directions
+ */
+qint64 ProxyConnection::bufferedBytes() const
+{
+    qint64 buffered = bytesToWrite() + bytesAvailable() + m_buffer.size() + m_pending.size() + m_targetBuffer.size();
+
+    if(m_target != NULL)
+        buffered += m_target->bytesToWrite() + m_target->bytesAvailable();
+
+    return buffered;
+}
+
+/**
+ * @brief ProxyConnection::totalBufferedBytes
+ * @return data held in memory by all the proxy connections
+ */
+qint64 ProxyConnection::totalBufferedBytes()
+{
+    QMutexLocker locker(&bufferedMutex);
+    return bufferedTotal;
+}
+
+void ProxyConnection::updateBufferedBytes()
+{
+    qint64 buffered = bufferedBytes();
+
+    if(buffered != m_reportedBuffered)
+    {
+        QMutexLocker locker(&bufferedMutex);
+        bufferedTotal += buffered - m_reportedBuffered;
+        m_reportedBuffered = buffered;
+    }
+}
+
+/**
+ * @brief ProxyConnection::processRequests
+ * Parse the buffered client data. A request head can arrive in several
+ * segments, and pipelined requests wait in the buffer until the response
+ * to the current one is complete
+ */
+void ProxyConnection::processRequests()
+{
+    while(!m_tunnel && state() == QAbstractSocket::ConnectedState)
+    {
+        if(m_parser.state() == HttpParser::HEAD)
+        {
+            if(m_busy)
+                return;
+
+            if(!m_parser.parseHead(m_buffer))
+            {
+                if(m_parser.state() == HttpParser::ERROR)
+                    sendError(m_parser.errorCode(), reasonPhrase(m_parser.errorCode()));
+                return;
+            }
+
+            m_busy = true;
+            handleRequest();
+        }
+        else if(m_parser.state() == HttpParser::BODY)
+        {
+            // continue when the remote server takes the queued data
+            if(m_forwarding && upstreamBuffered() >= m_highWatermark)
+                return;
+
+            QByteArray body = m_parser.readBody(m_buffer);
+
+            // the body of a request answered locally is discarded
+            if(m_forwarding && !body.isEmpty())
+                sendToTarget(body);
+
+            if(m_parser.state() == HttpParser::ERROR)
+            {
+                abortRequest();
+                return;
+            }
+
+            if(m_parser.state() != HttpParser::COMPLETE)
+                return;
+        }
+        else
+        {
+            // the request is complete, waiting for the response to finish
+            return;
+        }
+    }
+}
+
+/**
+ * @brief ProxyConnection::handleRequest
+ * A request head was received, decide how to answer it
+ */
+void ProxyConnection::handleRequest()
+{
+    const HttpMessage &request = m_parser.message();
+
+    qDebug("%s %s %s", request.method.constData(), request.target.constData(), request.version.constData());
+
+    m_keepAlive = request.keepAlive();
+    m_headRequest = request.method == "HEAD";
+
+    // probably an HTTPS connection
+    if(request.method == "CONNECT")
+    {
+        m_tunnel = true;
+
+        // anything sent after the CONNECT head belongs to the tunnel
+        m_pending = m_buffer;
+        m_buffer.clear();
+
+        // connect to remote server, path is host:port. The reply to the
+        // proxy client is sent once the connection is established
+        dropTarget();
+        if(!connectTarget(QString::fromLatin1(request.target)))
+            sendError(400, "Bad Request");
+        return;
+    }
+
+    if(!methods.contains(request.method))
+    {
+        sendError(501, "Not Implemented");
+        return;
+    }
+
+    // extract the host from the absolute URI, http://host[:port]/path
+    if(!request.target.toLower().startsWith("http://"))
+    {
+        sendError(400, "Bad Request");
+        return;
+    }
+
+    QByteArray host = request.target.mid(7);
+    int pos = host.indexOf('/');
+    QByteArray path = pos == -1 ? QByteArray("/") : host.mid(pos);
+    if(pos != -1)
+        host.truncate(pos);
+
+    m_host = QString::fromLatin1(host);
+
+    // check if the requested file exist on disk
+    if(request.method == "GET" || request.method == "HEAD")
+    {
+        m_rangeHeader = request.header("Range");
+        m_ifRange = request.header("If-Range");
+
+        if(fileExists(QString::fromLatin1(path)))
+        {
+            qDebug() << "Package found in cache";
+
+            if(m_settings->revalidateCache)
+            {
+                // ask the remote server if the local copy is still valid
+                m_revalidating = true;
+                m_response.clear();
+                m_pending = "HEAD " + path + " HTTP/1.1\r\n"
+                        "Host: " + host + "\r\n"
+                        "Connection: close\r\n\r\n";
+
+                dropTarget();
+                if(!connectTarget(m_host))
+                    serveFile();
+            }
+            else
+            {
+                serveFile();
+            }
+            return;
+        }
+
+        qDebug() << "Package not found in cache";
+    }
+
+    forwardRequest();
+}
+
+/**
+ * @brief ProxyConnection::forwardRequest
+ * Send the current request to the remote server, reusing the remote
+ * connection if it is still open to the same host
+ */
+void ProxyConnection::forwardRequest()
+{
+    HttpMessage request = m_parser.message();
+
+    // the remote server expects the path, not the absolute URI
+    int pos = request.target.indexOf('/', 7);
+    request.target = pos == -1 ? QByteArray("/") : request.target.mid(pos);
+    request.removeHeader("Proxy-Connection");
+
+    m_forwarding = true;
+    m_responseStarted = false;
+    m_responseParser.reset();
+    m_responseParser.setRequestMethod(request.method);
+    m_targetBuffer.clear();
+
+    sendRequest(request);
+}
+
+/**
+ * @brief ProxyConnection::sendRequest
+ * send a request to the remote server of m_host, on an idle connection
+ * from the pool or on a new one
+ */
+void ProxyConnection::sendRequest(const HttpMessage &request)
+{
+    dropTarget();
+
+    // use a warm connection if there is one idle in the pool
+    m_target = UpstreamPool::instance()->acquire(m_host);
+
+    if(m_target != NULL)
+    {
+        qDebug() << "Reusing connection to" << m_host;
+
+        m_reusedTarget = true;
+        m_targetHost = m_host;
+        m_target->setParent(this);
+        m_target->setReadBufferSize(m_highWatermark);
+        connect(m_target, SIGNAL(readyRead()), this, SLOT(receiveData()));
+        connect(m_target, SIGNAL(bytesWritten(qint64)), this, SLOT(targetBytesWritten()));
+        connect(m_target, SIGNAL(disconnected()), this, SLOT(targetDisconnected()));
+        m_target->write(request.toByteArray());
+        return;
+    }
+
+    // keep the request queued, it is sent to the remote server as soon
+    // as the connection is established
+    m_reusedTarget = false;
+    m_pending = request.toByteArray();
+
+    if(!connectTarget(m_host))
+    {
+        if(m_responseStarted)
+            abortRequest();
+        else
+            sendError(400, "Bad Request");
+    }
+}
+
+/**
+ * @brief ProxyConnection::releaseTarget
+ * Return the remote connection to the pool once the response is complete
+ */
+void ProxyConnection::releaseTarget()
+{
+    if(m_target == NULL)
+        return;
+
+    QTcpSocket *target = m_target;
+    m_target = NULL;
+
+    target->disconnect(this);
+
+    // the socket is still emitting the signal that completed the response,
+    // it can't change threads until the event loop is reached
+    m_idleTargets << qMakePair(m_targetHost, target);
+    QMetaObject::invokeMethod(this, "parkTargets", Qt::QueuedConnection);
+}
+
+void ProxyConnection::parkTargets()
+{
+    for(int i = 0; i < m_idleTargets.size(); i++)
+        UpstreamPool::instance()->release(m_idleTargets[i].first, m_idleTargets[i].second);
+
+    m_idleTargets.clear();
+}
+
+/**
+ * @brief ProxyConnection::sendToTarget
+ * Send data to the remote server, or queue it until it is connected
+ */
+void ProxyConnection::sendToTarget(const QByteArray &data)
+{
+    if(m_target != NULL && m_target->state() == QAbstractSocket::ConnectedState)
+        m_target->write(data);
+    else
+        m_pending.append(data);
+}
+
+/**
+ * @brief ProxyConnection::responseFinished
+ * The response to the current request was sent, continue with the next
+ * request on persistent connections or close the connection otherwise
+ */
+void ProxyConnection::responseFinished()
+{
+    stopCaching();
+    m_busy = false;
+    m_forwarding = false;
+
+    // the rest of the request body can't be told apart from the next request
+    if(!m_keepAlive || m_parser.state() != HttpParser::COMPLETE)
+    {
+        disconnectFromHost();
+        return;
+    }
+
+    m_parser.reset();
+
+    // pipelined requests are already in the buffer, process them from the
+    // event loop to avoid recursion
+    QMetaObject::invokeMethod(this, "readProxyClient", Qt::QueuedConnection);
+}
+
+/**
+ * @brief ProxyConnection::abortRequest
+ * The exchange can't continue, drop both connections
+ */
+void ProxyConnection::abortRequest()
+{
+    if(m_fetchingGap)
+        FetchRegistry::instance()->release(m_fileName, this);
+
+    m_forwarding = false;
+    m_fetchingGap = false;
+    m_waitingFetch = false;
+    stopCaching();
+    dropTarget();
+    releaseFile();
+    abort();
+}
+
+/**
+ * @brief ProxyConnection::targetConnected
+ * The remote server accepted the connection, send the queued data
+ */
+void ProxyConnection::targetConnected()
+{
+    m_connectTimer.stop();
+
+    if(m_tunnel)
+    {
+        // send OK to proxy client
+        write("HTTP/1.1 200 Connection established\r\n"
+              "Proxy-agent: QPSNProxy/0.1\r\n"
+              "\r\n");
+
+        // connect slots to read and delete the sockets
+        connect(m_target, SIGNAL(readyRead()), this, SLOT(receiveData()));
+        connect(m_target, SIGNAL(disconnected()), this, SLOT(closeConnections()));
+    }
+    else
+    {
+        if(m_revalidating)
+            connect(m_target, SIGNAL(readyRead()), this, SLOT(revalidateFile()));
+        else
+            connect(m_target, SIGNAL(readyRead()), this, SLOT(receiveData()));
+
+        // delete the remote socket on disconnection
+        connect(m_target, SIGNAL(disconnected()), this, SLOT(targetDisconnected()));
+    }
+
+    // data received from the proxy client while the connection was in progress
+    if(!m_pending.isEmpty())
+    {
+        m_target->write(m_pending);
+        m_pending.clear();
+    }
+}
+
+/**
+ * @brief ProxyConnection::targetError
+ * Report a failed connection attempt to the proxy client
+ * @param error socket error of the remote connection
+ */
+void ProxyConnection::targetError(QAbstractSocket::SocketError error)
+{
+    // errors after the connection is established are handled on disconnection
+    if(!m_connectTimer.isActive())
+        return;
+
+    m_connectTimer.stop();
+    qDebug() << "Cannot connect to remote server:" << error << m_target->errorString();
+
+    // the other addresses of the server could still work
+    if(connectNextAddress())
+    {
+        m_connectTimer.start();
+        return;
+    }
+
+    dropTarget();
+
+    // the remote server is unreachable, the local copy is still good
+    if(m_revalidating)
+    {
+        m_revalidating = false;
+        serveFile();
+        return;
+    }
+
+    // the client already got part of the response
+    if(m_responseStarted)
+    {
+        abortRequest();
+        return;
+    }
+
+    sendError(502, "Bad Gateway");
+}
+
+/**
+ * @brief ProxyConnection::targetTimeout
+ * The remote server didn't accept the connection in time
+ */
+void ProxyConnection::targetTimeout()
+{
+    qDebug() << "Connection to remote server timed out";
+
+    if(connectNextAddress())
+    {
+        m_connectTimer.start();
+        return;
+    }
+
+    dropTarget();
+
+    if(m_revalidating)
+    {
+        m_revalidating = false;
+        serveFile();
+        return;
+    }
+
+    if(m_responseStarted)
+    {
+        abortRequest();
+        return;
+    }
+
+    sendError(504, "Gateway Timeout");
+}
+
+/**
+ * @brief ProxyConnection::dropTarget
+ * Close the remote connection without waiting for pending data
+ */
+void ProxyConnection::dropTarget()
+{
+    if(m_target == NULL)
+        return;
+
+    QTcpSocket *target = m_target;
+    m_target = NULL;
+    m_lookupName.clear();
+    m_targetAddresses.clear();
+    m_connectTimer.stop();
+
+    target->disconnect(this);
+    target->abort();
+    target->deleteLater();
+}
+
+void ProxyConnection::targetDisconnected()
+{
+    QTcpSocket *target = m_target;
+    m_target = NULL;
+
+    // data that was held back by the flow control
+    m_targetBuffer.append(target->readAll());
+    target->deleteLater();
+
+    // no usable answer to the HEAD request, keep using the local copy
+    if(m_revalidating)
+    {
+        m_revalidating = false;
+        m_response.clear();
+        serveFile();
+        return;
+    }
+
+    if(!m_forwarding)
+        return;
+
+    relayResponse();
+    if(!m_forwarding)
+        return;
+
+    // a response without length ends when the remote server closes
+    m_responseParser.finishBody();
+    if(m_responseParser.state() == HttpParser::COMPLETE)
+    {
+        m_keepAlive = false;
+        responseFinished();
+    }
+    else if(m_fetchingGap && m_reusedTarget && m_responseParser.state() == HttpParser::HEAD && m_targetBuffer.isEmpty())
+    {
+        qDebug() << "Reused connection closed, retrying range request";
+        fetchGap(m_gapStart, m_gapEnd);
+    }
+    else if(!m_responseStarted && m_reusedTarget && m_parser.state() == HttpParser::COMPLETE &&
+            (m_parser.message().method == "GET" || m_parser.message().method == "HEAD"))
+    {
+        // the idle connection was closed by the remote server before it got
+        // the request, retry it on a new connection
+        qDebug() << "Reused connection closed, retrying request";
+        forwardRequest();
+    }
+    else if(!m_responseStarted)
+    {
+        sendError(502, "Bad Gateway");
+    }
+    else
+    {
+        // the response is truncated, the client has to notice it
+        abort();
+    }
+}
+
+/**
+ * @brief ProxyConnection::sendError
+ * Send an error response to the proxy client and close the connection
+ * @param code HTTP status code
+ * @param reason HTTP reason phrase
+ */
+void ProxyConnection::sendError(int code, const QByteArray &reason)
+{
+    QByteArray body = QByteArray::number(code) + " " + reason + "\r\n";
+
+    QByteArray response = "HTTP/1.1 " + QByteArray::number(code) + " " + reason + "\r\n"
+            "Proxy-agent: QPSNProxy/0.1\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+            "Connection: close\r\n"
+            "\r\n" + body;
+
+    m_pending.clear();
+    m_forwarding = false;
+    releaseFile();
+
+    write(response);
+    disconnectFromHost();
+}
+
+QByteArray ProxyConnection::reasonPhrase(int code)
 {
+    switch(code)
+    {
+    case 400:
+        return "Bad Request";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 501:
+        return "Not Implemented";
+    case 502:
+        return "Bad Gateway";
+    case 504:
+        return "Gateway Timeout";
+    case 505:
+        return "HTTP Version Not Supported";
+    default:
+        return "Error";
+    }
+}
+
+/**
+ * @brief ProxyConnection::startSplice
+ * hand an established tunnel over to a SpliceTunnel once nothing is left
+ * on the Qt buffers of both sockets, from then on the data is moved by
+ * the kernel. Does nothing on other platforms or while data is pending
+ */
+void ProxyConnection::startSplice()
+{
+#ifdef Q_OS_LINUX
+    if(!m_settings->spliceTunnel || !m_spliceEnabled || !m_tunnel || m_target == NULL || m_connectTimer.isActive())
+        return;
+
+    if(state() != QAbstractSocket::ConnectedState || m_target->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    if(bytesToWrite() > 0 || bytesAvailable() > 0 || !m_pending.isEmpty() ||
+            m_target->bytesToWrite() > 0 || m_target->bytesAvailable() > 0)
+        return;
+
+    int client = ::dup(socketDescriptor());
+    int remote = ::dup(m_target->socketDescriptor());
+
+    if(client == -1 || remote == -1)
+    {
+        if(client != -1)
+            ::close(client);
+        if(remote != -1)
+            ::close(remote);
+
+        m_spliceEnabled = false;
+        return;
+    }
+
+    SpliceTunnel *tunnel = new SpliceTunnel(client, remote, this);
+    connect(tunnel, SIGNAL(finished()), this, SLOT(spliceFinished()));
+
+    // the duplicated descriptors keep both connections open, the Qt
+    // sockets are closed without letting anyone know about it
+    m_target->disconnect(this);
+    m_target->abort();
+    m_target->deleteLater();
+    m_target = NULL;
+
+    blockSignals(true);
+    abort();
+    blockSignals(false);
+
+    updateBufferedBytes();
+
+    if(!tunnel->start())
+    {
+        qWarning("Cannot create the pipes for the tunnel");
+        delete tunnel;
+        deleteLater();
+    }
+#endif
+}
+
+/**
+ * @brief ProxyConnection::spliceFinished
+ * both sides of a spliced tunnel were closed
+ */
+void ProxyConnection::spliceFinished()
+{
+#ifdef Q_OS_LINUX
+    SpliceTunnel *tunnel = qobject_cast<SpliceTunnel *>(sender());
+
+    if(tunnel != NULL)
+    {
+        qDebug("Tunnel to %s finished, %lld bytes sent, %lld bytes received", qPrintable(m_targetHost),
+               tunnel->bytesUploaded(), tunnel->bytesDownloaded());
+        tunnel->deleteLater();
+    }
+#endif
+
+    // the socket was aborted quietly, the worker only learns about it here
+    deleteLater();
+}
+
+void ProxyConnection::closeConnections()
+{
+    write(m_target->readAll());
+    m_target->close();
+    m_target->deleteLater();
+    m_target = NULL;
+    close();
+}
+
+/**
+ * @brief ProxyConnection::revalidateFile
+ * read the response to the HEAD request sent to the remote server and
+ * decide if the local file can be used for the response
+ */
+void ProxyConnection::revalidateFile()
+{
+    m_response.append(m_target->readAll());
+
+    HttpParser parser(HttpParser::RESPONSE);
+    parser.setRequestMethod("HEAD");
+
+    if(!parser.parseHead(m_response))
+    {
+        if(parser.state() != HttpParser::ERROR)
+            return;
+    }
+
+    const HttpMessage &response = parser.message();
+    bool ok = false;
+    qint64 length = response.header("Content-Length").toLongLong(&ok);
+    QByteArray etag = response.header("ETag");
+
+    m_response.clear();
+    m_revalidating = false;
+    dropTarget();
+
+    if(parser.state() != HttpParser::ERROR && response.statusCode == 200 && ok && length == m_fileSize &&
+            (etag.isEmpty() || m_fileEtag.isEmpty() || etag == m_fileEtag))
+    {
+        serveFile();
+    }
+    else
+    {
+        qDebug() << "Local package is stale, forwarding request";
+        releaseFile();
+        forwardRequest();
+    }
 }
 
 /**
- * @brief ProxyConnection::readProxyClient
- * Called when new data is available on the proxy to read
+ * @brief ProxyConnection::serveFile
+ * build the response headers from the local file and send its contents,
+ * the remote server isn't contacted
  */
-void ProxyConnection::readProxyClient()
+void ProxyConnection::serveFile()
 {
-    QTcpSocket* socket = reinterpret_cast<QTcpSocket *>(sender());
+    qint64 size = m_fileSize;
+    QByteArray header;
 
-    // send data to real server if there is a connection in place
-    if(m_target != NULL)
+    // the validators of the store are kept, so the console can resume the
+    // download from the store or from the proxy
+    QByteArray last_modified = m_fileLastModified;
+    if(last_modified.isEmpty())
+        last_modified = http_date(QFileInfo(*m_file).lastModified()).toLatin1();
+
+    // a Range is only valid if the validator in If-Range matches our copy
+    if(m_ifRange.isEmpty() || m_ifRange == last_modified || (!m_fileEtag.isEmpty() && m_ifRange == m_fileEtag))
+        m_range.parse(m_rangeHeader, size);
+    else
+        m_range.parse(QByteArray(), size);
+
+    m_rangeIndex = 0;
+    m_spanStart = m_spanEnd = 0;
+    m_boundary.clear();
+
+    if(m_range.status() == RangeRequest::NOT_SATISFIABLE)
     {
-        m_target->write(socket->readAll());
-        return;
+        header = "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+                "Content-Range: bytes */" + QByteArray::number(size) + "\r\n"
+                "Content-Length: 0\r\n";
     }
-
-    // read header from the proxy client is at least a line is available
-    if(socket->canReadLine())
+    else if(m_range.status() == RangeRequest::PARTIAL && m_range.ranges().size() == 1)
+    {
+        const ByteRange &range = m_range.ranges().first();
+        header = "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Range: " + range.contentRange(size) + "\r\n"
+                "Content-Length: " + QByteArray::number(range.length()) + "\r\n"
+                "Content-Type: application/octet-stream\r\n";
+    }
+    else if(m_range.status() == RangeRequest::PARTIAL)
     {
-        // read the first line and split it into method/path/protocol
-        QStringList tokens = QString(socket->readLine()).split(QRegExp("[ \r\n][ \r\n]*"));
-        // read the rest of the headers
-        QString headers = socket->readAll();
+        m_boundary = "QPSNProxy" + QByteArray::number(QDateTime::currentMSecsSinceEpoch(), 16);
 
-        // probably an HTTPS connection
-        if(tokens[0] == QLatin1String("CONNECT"))
-        {
-            qDebug("CONNECT %s %s", qPrintable(tokens[1]), qPrintable(tokens[2]));
-            // connect to remote server, path is host:port
-            if(connectTarget(tokens[1]))
-            {
-                QTextStream os(socket);
-                os.setAutoDetectUnicode(true);
+        // the length of the multipart body has to be known beforehand
+        qint64 length = 0;
+        foreach(const ByteRange &range, m_range.ranges())
+            length += partHeader(range).size() + range.length();
+        length += partTrailer().size();
 
-                // send OK to proxy client
-                os << "HTTP/1.1 200 Connection established\r\n"
-                      "Proxy-agent: QPSNProxy/0.1\r\n"
-                      "\r\n";
+        header = "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Length: " + QByteArray::number(length) + "\r\n"
+                "Content-Type: multipart/byteranges; boundary=" + m_boundary + "\r\n";
+    }
+    else
+    {
+        header = "HTTP/1.1 200 OK\r\n"
+                "Content-Length: " + QByteArray::number(size) + "\r\n"
+                "Content-Type: application/octet-stream\r\n";
+    }
 
-                // connect slots to read and delete the sockets
-                connect(m_target, SIGNAL(readyRead()), this, SLOT(receiveData()));
-                connect(m_target, SIGNAL(disconnected()), this, SLOT(closeConnections()));
-            }
-            else
-            {
-                // connect failed, close the socket and delete it if is disconnected
-                socket->close();
-                if (socket->state() == QTcpSocket::UnconnectedState)
-                    delete socket;
-            }
-        }
-        // HTTP method is GET, POST, etc
-        else if(methods.contains(tokens[0]))
-        {
-            qDebug("%s %s %s", qPrintable(tokens[0]), qPrintable(tokens[1]), qPrintable(tokens[2]));
+    if(!m_fileEtag.isEmpty())
+        header += "ETag: " + m_fileEtag + "\r\n";
 
-            // extract the host from the path
-            QString host = tokens[1].mid(7);
-            int pos = host.indexOf(QChar('/'));
-            QString path = host.mid(pos);
-            host = host.left(pos);
+    header += "Accept-Ranges: bytes\r\n"
+            "Last-Modified: " + last_modified + "\r\n"
+            "Date: " + http_date(QDateTime::currentDateTimeUtc()).toLatin1() + "\r\n"
+            "Proxy-agent: QPSNProxy/0.1\r\n"
+            "Connection: " + (m_keepAlive ? "keep-alive" : "close") + "\r\n"
+            "\r\n";
 
-            //connect to remote server, using extracted host
-            if(connectTarget(host))
-            {
-                QTextStream os(m_target);
-                os.setAutoDetectUnicode(true);
+    write(header);
 
-                // send the original method/path/protocol to remote server
-                os << tokens[0] << " " << path << " " << tokens[2] << "\r\n" << headers;
+    if(m_headRequest || m_range.status() == RangeRequest::NOT_SATISFIABLE || size == 0)
+    {
+        releaseFile();
+        responseFinished();
+        return;
+    }
 
-                // check if the requested file exist on disk
-                if(tokens[0] == "GET")
-                {
-                    QStringList header_list = headers.split(QRegExp("[\r\n]"));
-                    qint64 start_range = 0;
-
-                    foreach(const QString &header, header_list)
-                    {
-                        if(header.startsWith("Range: "))
-                        {
-                            QRegExp valid_input("Range: bytes=(\\d+)-(\\d*)");
-                            if(valid_input.indexIn(header) != -1)
-                            {
-                                start_range = valid_input.cap(1).toLongLong();
-                                m_end_range = valid_input.cap(2).toLongLong();
-                                if(m_end_range == 0)
-                                    m_end_range = -1;
-                            }
-                        }
-                    }
-                    if(fileExists(path, start_range))
-                    {
-                        qDebug() << "Package found in cache";
-                        connect(m_target, SIGNAL(readyRead()), this, SLOT(prepareFileTransfer()));
-                    }
-                    else
-                    {
-                        qDebug() << "Package not found in cache";
-                        connect(m_target, SIGNAL(readyRead()), this, SLOT(receiveData()));
-                    }
-                }
-                else
-                {
-                    connect(m_target, SIGNAL(readyRead()), this, SLOT(receiveData()));
-                }
+    m_sender = FileSender::create(this, m_file, m_settings->transferMethod, this);
+    connect(m_sender, SIGNAL(finished()), this, SLOT(fileTransferFinished()));
+    connect(m_sender, SIGNAL(failed()), this, SLOT(closeFileConnection()));
 
-                // delete the remote socket on disconnection
-                connect(m_target, SIGNAL(disconnected()), m_target, SLOT(deleteLater()));
-        }
-            else
-            {
-                // connect failed, close the socket and delete it if is disconnected
-                socket->close();
-                if (socket->state() == QTcpSocket::UnconnectedState)
-                    delete socket;
-            }
-        }
-    }
+    sendNextRange();
 }
 
-void ProxyConnection::closeConnections()
+/**
+ * @brief ProxyConnection::sendNextRange
+ * start the transfer of the next requested range of the file
+ * @return false if there are no ranges left
+ */
+bool ProxyConnection::sendNextRange()
 {
-    m_target->close();
-    m_target->deleteLater();
-    close();
+    // the rest of a range split between the disk and the remote server
+    if(m_spanStart < m_spanEnd)
+    {
+        sendSpan();
+        return true;
+    }
+
+    if(m_range.status() == RangeRequest::FULL)
+    {
+        if(m_rangeIndex++ > 0)
+            return false;
+
+        m_spanStart = 0;
+        m_spanEnd = m_fileSize;
+        sendSpan();
+        return true;
+    }
+
+    if(m_rangeIndex >= m_range.ranges().size())
+    {
+        if(!m_boundary.isEmpty())
+            write(partTrailer());
+        return false;
+    }
+
+    const ByteRange &range = m_range.ranges().at(m_rangeIndex++);
+
+    // the part header is queued on the socket, the sender waits until
+    // it is written before sending the file data
+    if(!m_boundary.isEmpty())
+        write(partHeader(range));
+
+    m_spanStart = range.start;
+    m_spanEnd = range.end + 1;
+    sendSpan();
+    return true;
 }
 
 /**
- * @brief ProxyConnection::prepareFileTransfer
- * read the original request from the proxy client and use a local file
- * for the response
+ * @brief ProxyConnection::sendSpan
+ * send the data of the current range that is present on disk, up to the
+ * next hole. A hole is fetched from the remote server instead
  */
-void ProxyConnection::prepareFileTransfer()
+void ProxyConnection::sendSpan()
 {
-    QTcpSocket* socket = reinterpret_cast<QTcpSocket *>(sender());
+    qint64 start = m_spanStart;
+    qint64 end = m_spanEnd;
 
-    // read header from the proxy client is at least a line is available
-    while(socket->canReadLine())
+    if(m_partialFile)
     {
-        // read a line from the header
-        QString header = QString(socket->readLine());
+        // the range map is checked again, the file could be growing
+        PackageEntry entry;
+        PackageIndex::instance()->find(m_fileName, entry);
 
-        // if the content length is read then change it with the size of the local file
-        if(header.startsWith("Content-Length: ", Qt::CaseInsensitive))
-        {
-            QString newsize(QString("Content-length: %1\r\n").arg(m_file->size()));
-            write(newsize.toLocal8Bit());
-        }
-        else
+        qint64 missing = entry.ranges.firstMissing(start);
+        if(missing == start)
         {
-            // send the header to the proxy client
-            write(header.toLocal8Bit());
-        }
+            qint64 next = entry.ranges.nextPresent(start);
+            if(next != -1)
+                end = qMin(end, next);
 
-        // check if the line is the end of the header
-        if(header == "\r\n")
-        {
-            socket->close();
-            m_notifier = new QSocketNotifier(m_file->handle(), QSocketNotifier::Read);
-            connect(m_notifier, SIGNAL(activated(int)), this, SLOT(fileReadyRead(int)));
-            connect(this, SIGNAL(bytesWritten(qint64)), this, SLOT(continueTransfer(qint64)));
-            connect(this, SIGNAL(disconnected()), this, SLOT(closeFileConnection()));
-            break;
+            // someone else is downloading this data, wait until it is on disk
+            end = FetchRegistry::instance()->claim(m_fileName, start, end, this, "resumeSpan");
+            if(end == -1)
+            {
+                m_waitingFetch = true;
+                return;
+            }
+
+            fetchGap(start, end);
+            return;
         }
+
+        end = qMin(end, missing);
     }
+
+    m_spanStart = end;
+    m_sender->send(start, end - start);
 }
 
-void ProxyConnection::continueTransfer(qint64)
+/**
+ * @brief ProxyConnection::resumeSpan
+ * more data of the package is available, or the download that was
+ * providing it finished
+ */
+void ProxyConnection::resumeSpan()
 {
-    m_notifier->setEnabled(true);
+    if(!m_waitingFetch)
+        return;
+
+    m_waitingFetch = false;
+
+    if(m_sender != NULL)
+        sendSpan();
 }
 
 /**
- * @brief ProxyConnection::fileReadyRead
- * the file is ready to be read
- * @param socket identifier
+ * @brief ProxyConnection::fetchGap
+ * ask the remote server for a hole of a partial package, the data is
+ * sent to the client and stored on the file
  */
-void ProxyConnection::fileReadyRead(int)
+void ProxyConnection::fetchGap(qint64 start, qint64 end)
 {
-    char buffer[2 * 1024];
+    HttpMessage request = m_parser.message();
 
-    QSocketNotifier* notifier = reinterpret_cast<QSocketNotifier *>(sender());
+    int pos = request.target.indexOf('/', 7);
+    request.method = "GET";
+    request.target = pos == -1 ? QByteArray("/") : request.target.mid(pos);
+    request.removeHeader("Proxy-Connection");
+    request.removeHeader("If-Range");
+    request.setHeader("Range", "bytes=" + QByteArray::number(start) + "-" + QByteArray::number(end - 1));
 
-    int read_size;
-    if(m_end_range != -1 && m_file->pos() + static_cast<int>(sizeof(buffer)) > m_end_range)
-        read_size = m_end_range - m_file->pos();
-    else
-        read_size = sizeof(buffer);
+    qDebug() << "Fetching missing range" << start << "-" << end - 1 << "of" << m_fileName;
 
-    int read = m_file->read(buffer, read_size);
+    m_gapStart = start;
+    m_gapEnd = end;
+    m_fetchingGap = true;
+    m_forwarding = true;
+    m_responseStarted = true;
+    m_responseParser.reset();
+    m_responseParser.setRequestMethod(request.method);
+    m_targetBuffer.clear();
 
-    if(read > 0 && read_size == sizeof(buffer) && isValid())
-        write(buffer, read);
-    else
-    {
-        m_file->close();
-        delete m_file;
-        m_file = NULL;
-        close();
-    }
-    notifier->setEnabled(false);
+    sendRequest(request);
+}
+
+/**
+ * @brief ProxyConnection::acceptGap
+ * @return true if the response has exactly the data of the hole
+ */
+bool ProxyConnection::acceptGap(const HttpMessage &response)
+{
+    qint64 first, last, total;
+
+    if(response.statusCode != 206 || response.hasHeader("Transfer-Encoding") || response.hasHeader("Content-Encoding"))
+        return false;
+
+    if(!parseContentRange(response.header("Content-Range"), &first, &last, &total))
+        return false;
+
+    // the package changed on the store since the stored data was fetched
+    QByteArray etag = response.header("ETag");
+    if(!etag.isEmpty() && !m_fileEtag.isEmpty() && etag != m_fileEtag)
+        return false;
+
+    return first == m_gapStart && last == m_gapEnd - 1 && total == m_fileSize &&
+            m_responseParser.contentLength() == m_gapEnd - m_gapStart;
+}
+
+QByteArray ProxyConnection::partHeader(const ByteRange &range) const
+{
+    return "\r\n--" + m_boundary + "\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "Content-Range: " + range.contentRange(m_fileSize) + "\r\n"
+            "\r\n";
+}
+
+QByteArray ProxyConnection::partTrailer() const
+{
+    return "\r\n--" + m_boundary + "--\r\n";
 }
 
+/**
+ * @brief ProxyConnection::fileTransferFinished
+ * all the data of the file was queued, continue with the next request
+ */
+void ProxyConnection::fileTransferFinished()
+{
+    if(sendNextRange())
+        return;
+
+    qDebug() << "File transfer complete:" << m_sender->bytesSent() << "bytes";
+    releaseFile();
+    responseFinished();
+}
+
+/**
+ * @brief ProxyConnection::closeFileConnection
+ * the transfer failed or the client went away, close the connection
+ */
 void ProxyConnection::closeFileConnection()
 {
-    if(m_file !=NULL)
+    if(m_file != NULL)
+        abortRequest();
+}
+
+void ProxyConnection::releaseFile()
+{
+    if(m_sender != NULL)
+    {
+        m_sender->disconnect(this);
+        m_sender->deleteLater();
+        m_sender = NULL;
+    }
+
+    if(m_file != NULL)
     {
         m_file->close();
         delete m_file;
         m_file = NULL;
-        m_notifier->setEnabled(false);
-        m_notifier->deleteLater();
-        close();
+        PackageIndex::instance()->release(m_fileName);
     }
 }
 
@@ -254,23 +1168,48 @@ void ProxyConnection::closeFileConnection()
  * @param path URL path of the file
  * @return true of the file was opened, false otherwise
  */
-bool ProxyConnection::fileExists(const QString &path, qint64 start_range)
+bool ProxyConnection::fileExists(const QString &path)
 {
-    QString data_path = DownloadItem::getPackageDir();
-    QFileInfo info(QUrl(path).path());
-    QFileInfo fileinfo(data_path + QDir::separator() + info.fileName());
-    if(fileinfo.exists())
+    PackageIndex *index = PackageIndex::instance();
+    QString name = QFileInfo(QUrl(path).path()).fileName();
+    PackageEntry entry;
+
+    // the package is pinned while it is served, see releaseFile
+    if(name.isEmpty() || !index->acquire(name, entry))
+        return false;
+
+    // without the expected size there is no way to tell if the download
+    // in progress is complete. A corrupted package is downloaded again
+    if((entry.expectedSize <= 0 && entry.writing) || entry.integrity == PackageEntry::Corrupted)
     {
-        m_file = new QFile(fileinfo.absoluteFilePath());
-        if(!m_file->open(QIODevice::ReadOnly))
-        {
-            delete m_file;
-            return false;
-        }
-        m_file->seek(start_range);
-        return true;
+        index->release(name);
+        return false;
+    }
+
+    // the missing data of a partial package is fetched while it is sent
+    m_fileName = name;
+    m_partialFile = entry.isPartial();
+    m_fileSize = entry.expectedSize > 0 ? entry.expectedSize : entry.size;
+    m_fileEtag = entry.etag;
+    m_fileLastModified = entry.lastModified;
+
+    // hot packages are read from the fast storage tier, the copy could
+    // have been dropped since the entry was read
+    m_file = new QFile(index->servePath(entry));
+    if(!m_file->open(QIODevice::ReadOnly) && entry.fast)
+    {
+        m_file->setFileName(index->filePath(name));
+        m_file->open(QIODevice::ReadOnly);
+    }
+
+    if(!m_file->isOpen())
+    {
+        delete m_file;
+        m_file = NULL;
+        index->release(name);
+        return false;
     }
-    return false;
+    return true;
 }
 
 /**
@@ -279,26 +1218,244 @@ bool ProxyConnection::fileExists(const QString &path, qint64 start_range)
  */
 void ProxyConnection::receiveData()
 {
-    QTcpSocket* socket = reinterpret_cast<QTcpSocket*>(sender());
-    write(socket->readAll());
+    // the client (or the disk, while a copy is stored) is slower than the
+    // remote server, the data stays on the remote socket (and the kernel)
+    // until it catches up
+    if(m_target == NULL || bytesToWrite() >= m_highWatermark || (m_cacheWriter != NULL && DiskWriter::instance()->isFull()))
+    {
+        updateBufferedBytes();
+        return;
+    }
+
+    // the data left over by the limiter is read when the timer fires
+    qint64 allowed = BandwidthLimiter::instance()->request(BandwidthLimiter::Wan, m_target->bytesAvailable(), &m_downloadThrottle);
+
+    if(m_tunnel)
+    {
+        write(m_target->read(allowed));
+        updateBufferedBytes();
+        startSplice();
+        return;
+    }
+
+    m_targetBuffer.append(m_target->read(allowed));
+    relayResponse();
+
+    updateBufferedBytes();
+}
+
+/**
+ * @brief ProxyConnection::relayResponse
+ * parse the response of the remote server to find where it ends, so the
+ * client connection can be reused afterwards
+ */
+void ProxyConnection::relayResponse()
+{
+    // nothing was asked, drop whatever the remote server sent
+    if(!m_forwarding)
+    {
+        m_targetBuffer.clear();
+        return;
+    }
+
+    while(m_forwarding)
+    {
+        if(m_responseParser.state() == HttpParser::HEAD)
+        {
+            if(!m_responseParser.parseHead(m_targetBuffer))
+            {
+                if(m_responseParser.state() == HttpParser::ERROR)
+                {
+                    dropTarget();
+                    if(m_responseStarted)
+                        abort();
+                    else
+                        sendError(502, "Bad Gateway");
+                }
+                return;
+            }
+
+            HttpMessage &response = m_responseParser.message();
+
+            // the hole of a partial package, the client already got the
+            // response headers
+            if(m_fetchingGap)
+            {
+                if(response.statusCode >= 100 && response.statusCode < 200)
+                {
+                    m_responseParser.reset();
+                    continue;
+                }
+
+                if(!acceptGap(response))
+                {
+                    qDebug() << "Unexpected response for the missing range:" << response.statusCode;
+                    abortRequest();
+                    return;
+                }
+
+                m_cacheWriter = CacheWriter::create(m_fileName, m_gapStart, m_fileSize, m_fileEtag);
+                continue;
+            }
+
+            // a response delimited by the end of the connection can't be
+            // followed by another one on the client connection either
+            if(m_responseParser.isCloseDelimited())
+                m_keepAlive = false;
+
+            if(!m_keepAlive)
+                response.setHeader("Connection", "close");
+
+            m_responseStarted = true;
+            write(response.toByteArray());
+
+            // interim responses are followed by the final one
+            if(response.statusCode >= 100 && response.statusCode < 200 && response.statusCode != 101)
+            {
+                m_responseParser.reset();
+                continue;
+            }
+
+            startCaching(response);
+        }
+
+        if(m_responseParser.state() == HttpParser::BODY)
+        {
+            QByteArray body = m_responseParser.readBody(m_targetBuffer);
+            if(!body.isEmpty())
+            {
+                write(body);
+
+                if(m_cacheWriter != NULL)
+                    m_cacheWriter->append(body);
+            }
+
+            if(m_responseParser.state() == HttpParser::ERROR)
+            {
+                abortRequest();
+                return;
+            }
+        }
+
+        if(m_responseParser.state() != HttpParser::COMPLETE)
+            return;
+
+        // the remote connection is kept for the next request if possible,
+        // a server answering before the whole request body was sent would
+        // take the rest of the body as the next request
+        bool requestSent = m_parser.state() == HttpParser::COMPLETE && m_pending.isEmpty() &&
+                m_target != NULL && m_target->bytesToWrite() == 0;
+
+        if(m_responseParser.message().keepAlive() && m_targetBuffer.isEmpty() && requestSent)
+            releaseTarget();
+        else
+            dropTarget();
+
+        // continue with the rest of the file
+        if(m_fetchingGap)
+        {
+            m_fetchingGap = false;
+            m_forwarding = false;
+            m_spanStart = m_gapEnd;
+            stopCaching();
+            FetchRegistry::instance()->release(m_fileName, this);
+            fileTransferFinished();
+            return;
+        }
+
+        responseFinished();
+    }
+}
+
+/**
+ * @brief ProxyConnection::startCaching
+ * keep a copy of a package downloaded from the remote server, so the
+ * next request for it is served from disk. Only plain bodies are stored,
+ * chunked responses are relayed with their framing
+ */
+void ProxyConnection::startCaching(const HttpMessage &response)
+{
+    stopCaching();
+
+    const HttpMessage &request = m_parser.message();
+
+    if(!m_settings->cacheDownloads || request.method != "GET")
+        return;
+
+    QString name = QFileInfo(QUrl(QString::fromLatin1(request.target)).path()).fileName();
+    if(!name.endsWith(".pkg", Qt::CaseInsensitive))
+        return;
+
+    qint64 length = m_responseParser.contentLength();
+    if(length <= 0 || response.hasHeader("Transfer-Encoding") || response.hasHeader("Content-Encoding"))
+        return;
+
+    qint64 offset = 0;
+    qint64 total = length;
+
+    if(response.statusCode == 206)
+    {
+        qint64 last;
+        if(!parseContentRange(response.header("Content-Range"), &offset, &last, &total) || last - offset + 1 != length)
+            return;
+    }
+    else if(response.statusCode != 200)
+    {
+        return;
+    }
+
+    QByteArray etag = response.header("ETag");
+    m_cacheWriter = CacheWriter::create(name, offset, total, etag);
+
+    // other requests for this package wait for the data instead of
+    // downloading it again
+    if(m_cacheWriter != NULL)
+    {
+        PackageIndex::instance()->setOrigin(name, QString::fromLatin1(request.target), etag, response.header("Last-Modified"));
+        m_cachedName = name;
+        FetchRegistry::instance()->add(name, offset, offset + length, this);
+    }
+}
+
+void ProxyConnection::stopCaching()
+{
+    if(m_cacheWriter != NULL)
+    {
+        m_cacheWriter->finish();
+        m_cacheWriter = NULL;
+    }
+
+    if(!m_cachedName.isEmpty())
+    {
+        FetchRegistry::instance()->release(m_cachedName, this);
+        m_cachedName.clear();
+    }
 }
 
 /**
  * @brief ProxyConnection::connectTarget
- * connect to the remote server
+ * start an asynchronous connection to the remote server, the result is
+ * reported by targetConnected, targetError or targetTimeout
  * @param host hostname to connect
- * @return true if the connection was successful, false otherwise
+ * @return true if the connection attempt was started, false otherwise
  */
 bool ProxyConnection::connectTarget(const QString &host)
 {
     QString address;
-    qint16 port;
-    int pos = host.indexOf(QChar(':'));
+    quint16 port;
+    int pos = host.lastIndexOf(QChar(':'));
+
+    // the colons of an IPv6 literal are inside the brackets
+    if(pos != -1 && pos < host.lastIndexOf(QChar(']')))
+        pos = -1;
 
     if(pos != -1)
     {
+        bool ok;
         address = host.left(pos);
-        port = host.mid(pos+1).toShort();
+        port = host.mid(pos+1).toUShort(&ok);
+        if(!ok)
+            return false;
     }
     else
     {
@@ -306,8 +1463,79 @@ bool ProxyConnection::connectTarget(const QString &host)
         port = 80;
     }
 
-    m_target = new QTcpSocket();
+    // IPv6 literals are enclosed in brackets
+    if(address.startsWith(QChar('[')) && address.endsWith(QChar(']')))
+        address = address.mid(1, address.size() - 2);
+
+    if(address.isEmpty())
+        return false;
+
+    m_targetHost = host;
+    m_target = new QTcpSocket(this);
+    m_target->setReadBufferSize(m_highWatermark);
+    connect(m_target, SIGNAL(connected()), this, SLOT(targetConnected()));
+    connect(m_target, SIGNAL(bytesWritten(qint64)), this, SLOT(targetBytesWritten()));
+    connect(m_target, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(targetError(QAbstractSocket::SocketError)));
+
+    // the timeout covers the name lookup too
+    m_connectTimer.start(m_settings->connectTimeout * 1000);
+    m_targetPort = port;
+    m_lookupName = address;
+    m_targetName = address;
+
+    QHostInfo info;
+    if(HostCache::instance()->lookup(address, info, this, "hostResolved"))
+        connectResolved(info);
+
+    return true;
+}
+
+/**
+ * @brief ProxyConnection::hostResolved
+ * the name of the remote server was resolved by the DNS cache
+ */
+void ProxyConnection::hostResolved(const QHostInfo &info)
+{
+    // the connection attempt was abandoned while the lookup was running
+    if(m_target == NULL || m_target->state() != QAbstractSocket::UnconnectedState ||
+            m_lookupName.compare(info.hostName(), Qt::CaseInsensitive) != 0)
+        return;
+
+    connectResolved(info);
+}
+
+void ProxyConnection::connectResolved(const QHostInfo &info)
+{
+    m_lookupName.clear();
+
+    if(info.error() != QHostInfo::NoError || info.addresses().isEmpty())
+    {
+        targetError(QAbstractSocket::HostNotFoundError);
+        return;
+    }
+
+    m_targetAddresses = info.addresses();
+    m_target->connectToHost(m_targetAddresses.first(), m_targetPort);
+}
+
+/**
+ * @brief ProxyConnection::connectNextAddress
+ * The current address of the remote server failed, it goes to the end of
+ * the cached entry and the next one is tried
+ * @return false if there are no addresses left
+ */
+bool ProxyConnection::connectNextAddress()
+{
+    if(m_targetAddresses.isEmpty())
+        return false;
+
+    HostCache::instance()->demote(m_targetName, m_targetAddresses.takeFirst());
+
+    if(m_targetAddresses.isEmpty())
+        return false;
 
-    m_target->connectToHost(address, port);
-    return m_target->waitForConnected();
+    qDebug() << "Trying the next address of" << m_targetName << m_targetAddresses.first();
+    m_target->abort();
+    m_target->connectToHost(m_targetAddresses.first(), m_targetPort);
+    return true;
 }
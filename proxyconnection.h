@@ -21,35 +21,132 @@
 #ifndef PROXYCONNECTION_H
 #define PROXYCONNECTION_H
 
+#include "byterange.h"
+#include "httpparser.h"
+
 #include <QFile>
-#include <QSocketNotifier>
+#include <QHostAddress>
+#include <QHostInfo>
+#include <QList>
+#include <QPair>
 #include <QTcpSocket>
+#include <QTimer>
+
+class CacheWriter;
+struct ProxySettings;
+class FileSender;
 
 class ProxyConnection : public QTcpSocket
 {
     Q_OBJECT
 public:
-    explicit ProxyConnection(QObject *parent = 0);
+    explicit ProxyConnection(const ProxySettings *settings, QObject *parent = 0);
+    ~ProxyConnection();
+
     bool connectTarget(const QString &host);
+    qint64 bufferedBytes() const;
+
+    static qint64 totalBufferedBytes();
 
 private slots:
     void readProxyClient();
+    void processRequests();
     void receiveData();
+    void clientBytesWritten();
+    void targetBytesWritten();
     void closeConnections();
-    void prepareFileTransfer();
-    void continueTransfer(qint64 bytes_written);
-    void fileReadyRead(int socket);
+    void hostResolved(const QHostInfo &info);
+    void targetConnected();
+    void targetError(QAbstractSocket::SocketError error);
+    void targetTimeout();
+    void targetDisconnected();
+    void revalidateFile();
+    void fileTransferFinished();
     void closeFileConnection();
+    void parkTargets();
+    void resumeSpan();
+    void spliceFinished();
 
 private:
-    bool fileExists(const QString &path, qint64 start_range);
-    void sendFile(const QString &path);
-    qint64 transferFile();
+    void handleRequest();
+    void forwardRequest();
+    void sendRequest(const HttpMessage &request);
+    void relayResponse();
+    void responseFinished();
+    void startCaching(const HttpMessage &response);
+    void stopCaching();
+    void abortRequest();
+    void sendToTarget(const QByteArray &data);
+    qint64 upstreamBuffered() const;
+    void updateBufferedBytes();
+    bool fileExists(const QString &path);
+    void serveFile();
+    bool sendNextRange();
+    void sendSpan();
+    void fetchGap(qint64 start, qint64 end);
+    bool acceptGap(const HttpMessage &response);
+    void releaseFile();
+    QByteArray partHeader(const ByteRange &range) const;
+    QByteArray partTrailer() const;
+    void sendError(int code, const QByteArray &reason);
+    void connectResolved(const QHostInfo &info);
+    bool connectNextAddress();
+    void dropTarget();
+    void releaseTarget();
+    void startSplice();
+
+    static QByteArray reasonPhrase(int code);
 
-    QSocketNotifier *m_notifier;
+    const ProxySettings *m_settings;
+    HttpParser m_parser;
+    HttpParser m_responseParser;
+    FileSender *m_sender;
+    CacheWriter *m_cacheWriter;
+    QString m_cachedName;
     QTcpSocket *m_target;
+    QList<QPair<QString, QTcpSocket *> > m_idleTargets;
+    QString m_targetHost;
+    QString m_lookupName;
+    QString m_targetName;
+    QList<QHostAddress> m_targetAddresses;
+    quint16 m_targetPort;
+    bool m_reusedTarget;
+    QTimer m_connectTimer;
+    QTimer m_uploadThrottle;
+    QTimer m_downloadThrottle;
+    QByteArray m_buffer;
+    QByteArray m_targetBuffer;
+    QByteArray m_pending;
+    QByteArray m_response;
+    QString m_host;
+    bool m_tunnel;
+    bool m_busy;
+    bool m_keepAlive;
+    bool m_forwarding;
+    bool m_responseStarted;
+    bool m_revalidating;
+    bool m_headRequest;
+    bool m_spliceEnabled;
     QFile *m_file;
-    qint64 m_end_range;
+    QString m_fileName;
+    qint64 m_fileSize;
+    QByteArray m_fileEtag;
+    QByteArray m_fileLastModified;
+    bool m_partialFile;
+    bool m_fetchingGap;
+    bool m_waitingFetch;
+    qint64 m_spanStart;
+    qint64 m_spanEnd;
+    qint64 m_gapStart;
+    qint64 m_gapEnd;
+    QByteArray m_rangeHeader;
+    QByteArray m_ifRange;
+    QByteArray m_boundary;
+    RangeRequest m_range;
+    int m_rangeIndex;
+    qint64 m_highWatermark;
+    qint64 m_lowWatermark;
+    qint64 m_reportedBuffered;
 };
 
 #endif // PROXYCONNECTION_H
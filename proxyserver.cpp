@@ -19,27 +19,145 @@
  */
 
 #include "proxyserver.h"
+#include "diskwriter.h"
+#include "hostcache.h"
+#include "packageindex.h"
 #include "proxyconnection.h"
+#include "proxyworker.h"
+#include "upstreampool.h"
+
 #include <QDebug>
-#include <QTcpSocket>
+#include <QMetaObject>
+
+// the connection and buffer figures are logged this often, in milliseconds
+static const int statsInterval = 60 * 1000;
 
-ProxyServer::ProxyServer(QObject *parent) :
+/**
+ * @brief ProxyServer::ProxyServer
+ * Creates the listening server and its pool of worker threads
+ * @param workers number of worker threads, if zero or negative then
+ * one thread per CPU core is used
+ */
+ProxyServer::ProxyServer(int workers, QObject *parent) :
     QTcpServer(parent)
-{    
+{
+    qRegisterMetaType<qintptr>("qintptr");
+
+    // create the shared connection pool, DNS cache, package index and
+    // disk writer on the main thread
+    UpstreamPool::instance();
+    HostCache::instance();
+    PackageIndex::instance();
+    DiskWriter::instance();
+
+    if(workers <= 0)
+        workers = qMax(QThread::idealThreadCount(), 1);
+
+    for(int i = 0; i < workers; i++)
+    {
+        QThread *thread = new QThread(this);
+        ProxyWorker *worker = new ProxyWorker();
+        worker->moveToThread(thread);
+
+        // the worker and its connections are deleted on its own thread
+        connect(thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+
+        thread->setObjectName(QString("ProxyWorker%1").arg(i));
+        thread->start();
+
+        m_threads << thread;
+        m_workers << worker;
+    }
+
+    qDebug() << "Proxy started with" << workers << "worker threads";
+
+    connect(&m_statsTimer, SIGNAL(timeout()), this, SLOT(logStats()));
+    m_statsTimer.start(statsInterval);
 }
 
+ProxyServer::~ProxyServer()
+{
+    close();
+
+    foreach(QThread *thread, m_threads)
+    {
+        thread->quit();
+        thread->wait();
+    }
+}
 
+int ProxyServer::workerCount() const
+{
+    return m_workers.size();
+}
+
+int ProxyServer::connectionCount() const
+{
+    int count = 0;
+
+    foreach(ProxyWorker *worker, m_workers)
+        count += worker->connectionCount();
+
+    return count;
+}
+
+/**
+ * @brief ProxyServer::bufferedBytes
+ * @return data held in memory by the relays of all the connections
+ */
+qint64 ProxyServer::bufferedBytes() const
+{
+    return ProxyConnection::totalBufferedBytes();
+}
+
+/**
+ * @brief ProxyServer::loadSettings
+ * Make the workers read the settings again, on their own threads
+ */
+void ProxyServer::loadSettings()
+{
+    foreach(ProxyWorker *worker, m_workers)
+        QMetaObject::invokeMethod(worker, "loadSettings", Qt::QueuedConnection);
+}
+
+/**
+ * @brief ProxyServer::incomingConnection
+ * Hands the accepted descriptor to the least loaded worker, the
+ * ProxyConnection is created on the worker thread
+ * @param handle native socket descriptor
+ */
 void ProxyServer::incomingConnection(qintptr handle)
 {
-    ProxyConnection* s = new ProxyConnection(this);
-    connect(s, SIGNAL(readyRead()), s, SLOT(readProxyClient()));
-    connect(s, SIGNAL(disconnected()), this, SLOT(discardClient()));
-    s->setSocketDescriptor(handle);
+    ProxyWorker *worker = leastLoadedWorker();
+    worker->reserveConnection();
+    QMetaObject::invokeMethod(worker, "addConnection", Qt::QueuedConnection, Q_ARG(qintptr, handle));
 }
 
-void ProxyServer::discardClient()
+ProxyWorker *ProxyServer::leastLoadedWorker() const
 {
-    qDebug() << "Client disconnected";
-    ProxyConnection* socket = (ProxyConnection*)sender();
-    socket->deleteLater();
+    ProxyWorker *selected = m_workers.first();
+
+    foreach(ProxyWorker *worker, m_workers)
+    {
+        if(worker->connectionCount() < selected->connectionCount())
+            selected = worker;
+    }
+
+    return selected;
+}
+
+/**
+ * @brief ProxyServer::logStats
+ * Report the load of the proxy, only while it is in use
+ */
+void ProxyServer::logStats()
+{
+    int connections = connectionCount();
+    int idle = UpstreamPool::instance()->idleCount();
+
+    if(connections == 0 && idle == 0)
+        return;
+
+    qDebug("Proxy: %d connections on %d workers, %lld bytes buffered, %d idle remote connections",
+           connections, workerCount(), bufferedBytes(), idle);
 }
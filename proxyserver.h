@@ -21,18 +21,39 @@
 #ifndef PROXYSERVER_H
 #define PROXYSERVER_H
 
+#include <QList>
 #include <QTcpServer>
+#include <QThread>
+#include <QTimer>
+
+class ProxyWorker;
 
 class ProxyServer : public QTcpServer
 {
     Q_OBJECT
 public:
-    explicit ProxyServer(QObject *parent = 0);
+    explicit ProxyServer(int workers = 0, QObject *parent = 0);
+    ~ProxyServer();
+
+    int workerCount() const;
+    int connectionCount() const;
+    qint64 bufferedBytes() const;
+
+public slots:
+    void loadSettings();
+
+protected:
     void incomingConnection(qintptr handle);
 
 private slots:
-    void discardClient();
+    void logStats();
+
+private:
+    ProxyWorker *leastLoadedWorker() const;
 
+    QList<QThread *> m_threads;
+    QList<ProxyWorker *> m_workers;
+    QTimer m_statsTimer;
 };
 
 #endif // PROXYSERVER_H
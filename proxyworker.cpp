@@ -0,0 +1,98 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "proxyworker.h"
+#include "proxyconnection.h"
+
+#include <QDebug>
+#include <QSettings>
+
+ProxyWorker::ProxyWorker(QObject *parent) :
+    QObject(parent), m_connections(0)
+{
+    loadSettings();
+}
+
+/**
+ * @brief ProxyWorker::loadSettings
+ * Called on the worker thread once the settings change, the connections
+ * already open use the new values from their next request
+ */
+void ProxyWorker::loadSettings()
+{
+    QSettings settings;
+    m_settings.revalidateCache = settings.value("revalidateCache", false).toBool();
+    m_settings.spliceTunnel = settings.value("spliceTunnel", true).toBool();
+    m_settings.cacheDownloads = settings.value("cacheDownloads", true).toBool();
+    m_settings.bufferSize = settings.value("proxyBufferSize", 512).toLongLong() * 1024;
+    m_settings.connectTimeout = settings.value("connectTimeout", 30).toInt();
+    m_settings.transferMethod = FileSender::preferredMethod();
+}
+
+/**
+ * @brief ProxyWorker::connectionCount
+ * @return number of connections assigned to this worker, including
+ * the ones that are still queued to be created
+ */
+int ProxyWorker::connectionCount() const
+{
+    return m_connections.load();
+}
+
+/**
+ * @brief ProxyWorker::reserveConnection
+ * Called from the server thread before the socket descriptor is queued
+ * so the load of the worker is accurate on the next accepted connection
+ */
+void ProxyWorker::reserveConnection()
+{
+    m_connections.ref();
+}
+
+/**
+ * @brief ProxyWorker::addConnection
+ * Creates the proxy connection for an accepted socket, runs on the worker thread
+ * @param handle native socket descriptor
+ */
+void ProxyWorker::addConnection(qintptr handle)
+{
+    ProxyConnection* s = new ProxyConnection(&m_settings, this);
+    connect(s, SIGNAL(readyRead()), s, SLOT(readProxyClient()));
+    connect(s, SIGNAL(disconnected()), this, SLOT(discardClient()));
+    connect(s, SIGNAL(destroyed()), this, SLOT(releaseConnection()));
+
+    if(!s->setSocketDescriptor(handle))
+    {
+        qDebug() << "Cannot use socket descriptor:" << s->errorString();
+        delete s;
+    }
+}
+
+void ProxyWorker::discardClient()
+{
+    qDebug() << "Client disconnected";
+    ProxyConnection* socket = (ProxyConnection*)sender();
+    socket->deleteLater();
+}
+
+void ProxyWorker::releaseConnection()
+{
+    m_connections.deref();
+}
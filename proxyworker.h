@@ -0,0 +1,65 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROXYWORKER_H
+#define PROXYWORKER_H
+
+#include "filesender.h"
+
+#include <QAtomicInt>
+#include <QObject>
+
+/**
+ * Settings used by the proxy connections, read once per worker instead of
+ * on each request
+ */
+struct ProxySettings
+{
+    bool revalidateCache;
+    bool spliceTunnel;
+    bool cacheDownloads;
+    qint64 bufferSize;
+    int connectTimeout;
+    FileSender::Method transferMethod;
+};
+
+class ProxyWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ProxyWorker(QObject *parent = 0);
+
+    int connectionCount() const;
+    void reserveConnection();
+
+public slots:
+    void addConnection(qintptr handle);
+    void loadSettings();
+
+private slots:
+    void discardClient();
+    void releaseConnection();
+
+private:
+    QAtomicInt m_connections;
+    ProxySettings m_settings;
+};
+
+#endif // PROXYWORKER_H
@@ -0,0 +1,310 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "resumejournal.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QFileInfo>
+
+#include <errno.h>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// largest block covered by a single hash
+static const qint64 journalBlock = 4 * 1024 * 1024;
+
+// the package and the journal are synced once this many milliseconds
+// passed since the last sync, or once this much data was written
+static const qint64 syncInterval = 2000;
+static const qint64 syncBytes = 64 * 1024 * 1024;
+
+// data read back at the end of each range before a download resumes
+static const qint64 verifyWindow = 8 * 1024 * 1024;
+
+static const quint32 recordMagic = 0x51504a52;
+
+// magic, offset, length, SHA-1 and checksum of the record
+static const int recordSize = 4 + 8 + 8 + 20 + 2;
+static const int hashSize = 20;
+
+ResumeJournal::ResumeJournal(const QString &path) :
+    m_file(journalPath(path)), m_hash(QCryptographicHash::Sha1), m_unsynced(0)
+{
+    m_block.offset = 0;
+    m_block.length = 0;
+    m_lastSync.start();
+}
+
+QString ResumeJournal::journalPath(const QString &path)
+{
+    QFileInfo info(path);
+    return info.absolutePath() + "/." + info.fileName() + ".journal";
+}
+
+/**
+ * @brief ResumeJournal::remove
+ * Drop the journal of a package that is complete, removed or going to be
+ * overwritten
+ */
+void ResumeJournal::remove(const QString &path)
+{
+    QFile::remove(journalPath(path));
+}
+
+/**
+ * @brief ResumeJournal::open
+ * Several writers of the same package can append to the journal at once,
+ * each record is written with a single call
+ */
+bool ResumeJournal::open()
+{
+    if(!m_file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered))
+    {
+        qWarning() << "Cannot open" << m_file.fileName() << m_file.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief ResumeJournal::add
+ * Hash data that was written to the package, it is added to the journal
+ * on the next sync
+ */
+void ResumeJournal::add(qint64 offset, const char *data, qint64 length)
+{
+    while(length > 0)
+    {
+        if(m_block.length > 0 && (offset != m_block.offset + m_block.length || m_block.length >= journalBlock))
+            finishBlock();
+
+        if(m_block.length == 0)
+            m_block.offset = offset;
+
+        qint64 size = qMin(length, journalBlock - m_block.length);
+        m_hash.addData(data, int(size));
+        m_block.length += size;
+        m_unsynced += size;
+
+        offset += size;
+        data += size;
+        length -= size;
+    }
+}
+
+/**
+ * @brief ResumeJournal::discard
+ * Forget the block being hashed, part of its data couldn't be written
+ */
+void ResumeJournal::discard()
+{
+    m_hash.reset();
+    m_block.length = 0;
+}
+
+bool ResumeJournal::needsSync() const
+{
+    return m_unsynced > 0 && (m_unsynced >= syncBytes || m_lastSync.elapsed() >= syncInterval);
+}
+
+/**
+ * @brief ResumeJournal::sync
+ * Make the data written to the package durable, then record it
+ * @param package file the data was written to
+ * @return false if the data or the journal couldn't be synced, the
+ * blocks are recorded on the next try
+ */
+bool ResumeJournal::sync(QFile *package)
+{
+    finishBlock();
+
+    if(m_blocks.isEmpty() || !m_file.isOpen())
+        return true;
+
+    if(!syncFile(package))
+    {
+        qWarning() << "Cannot sync" << package->fileName() << qt_error_string(errno);
+        return false;
+    }
+
+    QByteArray records;
+    foreach(const Block &block, m_blocks)
+        records += record(block);
+
+    if(m_file.write(records) != records.size() || !syncFile(&m_file))
+    {
+        qWarning() << "Cannot write" << m_file.fileName() << m_file.errorString();
+        return false;
+    }
+
+    m_blocks.clear();
+    m_unsynced = 0;
+    m_lastSync.restart();
+    return true;
+}
+
+void ResumeJournal::finishBlock()
+{
+    if(m_block.length == 0)
+        return;
+
+    m_block.hash = m_hash.result();
+    m_blocks << m_block;
+    m_hash.reset();
+    m_block.length = 0;
+}
+
+/**
+ * @brief ResumeJournal::recover
+ * Limit the ranges of a partial package to the data listed on its
+ * journal. The blocks at the end of each range are read back, since the
+ * data written right before a crash is the most likely to be damaged. A
+ * package stored before the journal existed gets a journal with its
+ * current ranges
+ * @param path package file, must not be written meanwhile
+ * @param ranges range map of the index, updated with the data that can
+ * be trusted
+ * @return true if the ranges changed
+ */
+bool ResumeJournal::recover(const QString &path, RangeMap *ranges)
+{
+    QFile file(journalPath(path));
+    QFile package(path);
+
+    if(!file.exists())
+    {
+        if(ranges->isEmpty() || !package.open(QIODevice::ReadOnly))
+            return false;
+
+        // unhashed blocks, nothing can be checked
+        ResumeJournal journal(path);
+        foreach(const ByteRange &range, ranges->ranges())
+        {
+            Block block = {range.start, range.length(), QByteArray()};
+            journal.m_blocks << block;
+        }
+
+        if(journal.open())
+            journal.sync(&package);
+        return false;
+    }
+
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QList<Block> blocks;
+    Block parsed;
+
+    // a record torn by the crash ends the journal
+    while(parseRecord(file.read(recordSize), &parsed))
+        blocks << parsed;
+
+    RangeMap journaled;
+    foreach(const Block &block, blocks)
+        journaled.add(ByteRange(block.offset, block.offset + block.length - 1));
+
+    RangeMap durable;
+    bool readable = package.open(QIODevice::ReadOnly);
+
+    foreach(const Block &block, blocks)
+    {
+        qint64 end = block.offset + block.length;
+
+        if(!block.hash.isEmpty() && end > journaled.firstMissing(block.offset) - verifyWindow)
+        {
+            bool valid = readable && package.seek(block.offset) &&
+                    QCryptographicHash::hash(package.read(block.length), QCryptographicHash::Sha1) == block.hash;
+
+            if(!valid)
+            {
+                qDebug() << "Damaged data on" << path << "at" << block.offset << ", downloading it again";
+                continue;
+            }
+        }
+
+        durable.add(ByteRange(block.offset, end - 1));
+    }
+
+    RangeMap limited = ranges->intersect(durable);
+    qint64 lost = ranges->presentBytes() - limited.presentBytes();
+
+    if(lost == 0)
+        return false;
+
+    qDebug() << "Resume journal of" << path << "dropped" << lost << "bytes that weren't on disk";
+    *ranges = limited;
+    return true;
+}
+
+QByteArray ResumeJournal::record(const Block &block)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+
+    // an empty hash is written as zeros and means the block is trusted
+    QByteArray hash = block.hash.leftJustified(hashSize, '\0', true);
+
+    out << recordMagic << block.offset << block.length;
+    out.writeRawData(hash.constData(), hashSize);
+    out << qChecksum(data.constData(), data.size());
+    return data;
+}
+
+bool ResumeJournal::parseRecord(const QByteArray &data, Block *block)
+{
+    if(data.size() != recordSize)
+        return false;
+
+    QDataStream in(data);
+    quint32 magic;
+    quint16 checksum;
+    char hash[hashSize];
+
+    in >> magic >> block->offset >> block->length;
+    in.readRawData(hash, hashSize);
+    in >> checksum;
+
+    if(magic != recordMagic || checksum != qChecksum(data.constData(), recordSize - 2) ||
+            block->offset < 0 || block->length <= 0)
+        return false;
+
+    block->hash = QByteArray(hash, hashSize);
+    if(block->hash == QByteArray(hashSize, '\0'))
+        block->hash.clear();
+
+    return true;
+}
+
+bool ResumeJournal::syncFile(QFile *file)
+{
+#if defined(Q_OS_LINUX)
+    return ::fdatasync(file->handle()) == 0;
+#elif defined(Q_OS_WIN)
+    return ::_commit(file->handle()) == 0;
+#else
+    return ::fsync(file->handle()) == 0;
+#endif
+}
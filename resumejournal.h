@@ -0,0 +1,79 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESUMEJOURNAL_H
+#define RESUMEJOURNAL_H
+
+#include "byterange.h"
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+
+/**
+ * Append only log of the data of a partial package that is known to be
+ * on disk, kept next to the package as a hidden file. The package is
+ * synced before the blocks written since the last sync are added to the
+ * journal, so after a crash or a power loss the journal only lists data
+ * that survived, even if the range map of the index claims more. Each
+ * block keeps the SHA-1 of its data, the blocks at the end of each range
+ * are checked again before the download resumes, a torn write is then
+ * downloaded again instead of ending up on the console.
+ */
+class ResumeJournal
+{
+public:
+    explicit ResumeJournal(const QString &path);
+
+    bool open();
+    void add(qint64 offset, const char *data, qint64 length);
+    void discard();
+    bool needsSync() const;
+    bool sync(QFile *package);
+
+    static QString journalPath(const QString &path);
+    static void remove(const QString &path);
+    static bool recover(const QString &path, RangeMap *ranges);
+
+private:
+    struct Block
+    {
+        qint64 offset;
+        qint64 length;
+        QByteArray hash;
+    };
+
+    void finishBlock();
+
+    static QByteArray record(const Block &block);
+    static bool parseRecord(const QByteArray &data, Block *block);
+    static bool syncFile(QFile *file);
+
+    QFile m_file;
+    QCryptographicHash m_hash;
+    Block m_block;
+    QList<Block> m_blocks;
+    qint64 m_unsynced;
+    QElapsedTimer m_lastSync;
+};
+
+#endif // RESUMEJOURNAL_H
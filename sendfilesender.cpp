@@ -0,0 +1,122 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sendfilesender.h"
+#include "bandwidthlimiter.h"
+
+#include <QDebug>
+
+#include <errno.h>
+#include <sys/sendfile.h>
+
+// upper limit of data sent on each wake up, so other connections of
+// the same worker thread get a chance to run
+static const qint64 maxSendPerCall = 4 * 1024 * 1024;
+
+SendfileSender::SendfileSender(QTcpSocket *socket, QFile *file, QObject *parent) :
+    FileSender(socket, file, parent), m_notifier(NULL), m_fallback(false)
+{
+}
+
+/**
+ * @brief SendfileSender::transfer
+ * Send as much data as the socket accepts without blocking
+ */
+void SendfileSender::transfer()
+{
+    if(m_fallback)
+    {
+        FileSender::transfer();
+        return;
+    }
+
+    // wait until the data queued by Qt (e.g. the response headers) is flushed
+    if(!m_active || m_socket->bytesToWrite() > 0)
+        return;
+
+    if(m_notifier)
+        m_notifier->setEnabled(false);
+
+    BandwidthLimiter *limiter = BandwidthLimiter::instance();
+    qint64 sent_now = 0;
+
+    while(m_remaining > 0 && sent_now < maxSendPerCall)
+    {
+        // the timer calls transfer again once the limiter allows more data
+        qint64 count = limiter->request(BandwidthLimiter::Lan, qMin(m_remaining, maxSendPerCall - sent_now), &m_throttle);
+        if(count == 0)
+            return;
+
+        off_t offset = m_offset;
+        ssize_t sent = ::sendfile(m_socket->socketDescriptor(), m_file->handle(), &offset, count);
+
+        // the socket can take less than what was granted
+        limiter->refund(BandwidthLimiter::Lan, count - qMax(qint64(sent), Q_INT64_C(0)));
+
+        if(sent > 0)
+        {
+            m_offset += sent;
+            m_remaining -= sent;
+            m_sent += sent;
+            sent_now += sent;
+        }
+        else if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if(sent < 0 && errno == EAGAIN)
+        {
+            waitForWritable();
+            return;
+        }
+        else if(sent < 0 && (errno == EINVAL || errno == ENOSYS) && m_sent == 0)
+        {
+            // the file system doesn't support sendfile, copy the data instead
+            qDebug() << "sendfile not supported, using buffered transfer";
+            m_fallback = true;
+            FileSender::transfer();
+            return;
+        }
+        else
+        {
+            // a zero return means the file was truncated under our feet
+            fail();
+            return;
+        }
+    }
+
+    if(m_remaining == 0)
+        complete();
+    else
+        waitForWritable();
+}
+
+void SendfileSender::waitForWritable()
+{
+    // the notifier is created only now since Qt has no write notifier
+    // registered for the socket while its write buffer is empty
+    if(m_notifier == NULL)
+    {
+        m_notifier = new QSocketNotifier(m_socket->socketDescriptor(), QSocketNotifier::Write, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(transfer()));
+    }
+
+    m_notifier->setEnabled(true);
+}
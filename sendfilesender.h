@@ -0,0 +1,49 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SENDFILESENDER_H
+#define SENDFILESENDER_H
+
+#include "filesender.h"
+
+#include <QSocketNotifier>
+
+/**
+ * Linux sender that moves the data from the file descriptor straight to
+ * the socket with sendfile(2), without copying it to user space. The
+ * transfer is paced by the writability of the socket.
+ */
+class SendfileSender : public FileSender
+{
+    Q_OBJECT
+public:
+    explicit SendfileSender(QTcpSocket *socket, QFile *file, QObject *parent = 0);
+
+protected slots:
+    void transfer();
+
+private:
+    void waitForWritable();
+
+    QSocketNotifier *m_notifier;
+    bool m_fallback;
+};
+
+#endif // SENDFILESENDER_H
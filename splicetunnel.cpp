@@ -0,0 +1,246 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "splicetunnel.h"
+#include "bandwidthlimiter.h"
+
+#include <QDebug>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// upper limit of data moved on each wake up, so other connections of
+// the same worker thread get a chance to run
+static const qint64 maxPumpPerCall = 4 * 1024 * 1024;
+
+static const int pipeSize = 256 * 1024;
+
+SpliceTunnel::SpliceTunnel(int client, int remote, QObject *parent) :
+    QObject(parent), m_client(client), m_remote(remote), m_pipeSize(pipeSize), m_finished(false)
+{
+    initDirection(m_upload, client, remote);
+    initDirection(m_download, remote, client);
+}
+
+SpliceTunnel::~SpliceTunnel()
+{
+    Direction *dirs[] = {&m_upload, &m_download};
+
+    for(int i = 0; i < 2; i++)
+    {
+        delete dirs[i]->readNotifier;
+        delete dirs[i]->writeNotifier;
+
+        if(dirs[i]->pipe[0] != -1)
+        {
+            ::close(dirs[i]->pipe[0]);
+            ::close(dirs[i]->pipe[1]);
+        }
+    }
+
+    ::close(m_client);
+    ::close(m_remote);
+}
+
+void SpliceTunnel::initDirection(Direction &dir, int from, int to)
+{
+    dir.from = from;
+    dir.to = to;
+    dir.pipe[0] = dir.pipe[1] = -1;
+    dir.inPipe = 0;
+    dir.total = 0;
+    dir.eof = false;
+    dir.done = false;
+    dir.readNotifier = NULL;
+    dir.writeNotifier = NULL;
+    dir.throttle = NULL;
+}
+
+/**
+ * @brief SpliceTunnel::start
+ * create the pipes and start moving data, the descriptors are owned by
+ * the tunnel even if this fails
+ * @return false if the pipes can't be created
+ */
+bool SpliceTunnel::start()
+{
+    if(!setupDirection(m_upload, SLOT(pumpUpload())) || !setupDirection(m_download, SLOT(pumpDownload())))
+        return false;
+
+    pump(m_upload);
+    pump(m_download);
+    return true;
+}
+
+bool SpliceTunnel::setupDirection(Direction &dir, const char *slot)
+{
+    if(::pipe2(dir.pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        dir.pipe[0] = dir.pipe[1] = -1;
+        return false;
+    }
+
+    // a bigger pipe means less wake ups, the default is 64 KiB
+    int size = ::fcntl(dir.pipe[1], F_SETPIPE_SZ, pipeSize);
+    if(size > 0)
+        m_pipeSize = qMin(m_pipeSize, size);
+    else
+        m_pipeSize = qMin(m_pipeSize, 64 * 1024);
+
+    dir.readNotifier = new QSocketNotifier(dir.from, QSocketNotifier::Read);
+    dir.writeNotifier = new QSocketNotifier(dir.to, QSocketNotifier::Write);
+    dir.writeNotifier->setEnabled(false);
+    connect(dir.readNotifier, SIGNAL(activated(int)), this, slot);
+    connect(dir.writeNotifier, SIGNAL(activated(int)), this, slot);
+
+    // the source is read again once the limiter has more data to give
+    dir.throttle = new QTimer(this);
+    dir.throttle->setSingleShot(true);
+    connect(dir.throttle, SIGNAL(timeout()), this, slot);
+    return true;
+}
+
+void SpliceTunnel::pumpUpload()
+{
+    pump(m_upload);
+}
+
+void SpliceTunnel::pumpDownload()
+{
+    pump(m_download);
+}
+
+/**
+ * @brief SpliceTunnel::pump
+ * move data from the source socket to the pipe and from the pipe to the
+ * destination socket until both would block
+ */
+void SpliceTunnel::pump(Direction &dir)
+{
+    if(m_finished || dir.done)
+        return;
+
+    qint64 moved = 0;
+    bool progress = true;
+
+    while(progress && moved < maxPumpPerCall)
+    {
+        progress = false;
+
+        qint64 allowed = 0;
+        if(!dir.eof && dir.inPipe < m_pipeSize)
+            allowed = BandwidthLimiter::instance()->request(BandwidthLimiter::Wan, m_pipeSize - dir.inPipe, dir.throttle);
+
+        if(allowed > 0)
+        {
+            ssize_t n = ::splice(dir.from, NULL, dir.pipe[1], NULL, allowed, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            BandwidthLimiter::instance()->refund(BandwidthLimiter::Wan, allowed - qMax(qint64(n), Q_INT64_C(0)));
+
+            if(n > 0)
+            {
+                dir.inPipe += n;
+                progress = true;
+            }
+            else if(n == 0)
+            {
+                dir.eof = true;
+            }
+            else if(errno != EAGAIN && errno != EINTR)
+            {
+                // the connection was reset, nothing else will arrive
+                dir.eof = true;
+            }
+        }
+
+        if(dir.inPipe > 0)
+        {
+            ssize_t n = ::splice(dir.pipe[0], NULL, dir.to, NULL, dir.inPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if(n > 0)
+            {
+                dir.inPipe -= n;
+                dir.total += n;
+                moved += n;
+                progress = true;
+            }
+            else if(n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                fail();
+                return;
+            }
+        }
+    }
+
+    // the source reached its end and everything was delivered, forward the half close
+    if(dir.eof && dir.inPipe == 0)
+    {
+        ::shutdown(dir.to, SHUT_WR);
+        dir.done = true;
+        dir.readNotifier->setEnabled(false);
+        dir.writeNotifier->setEnabled(false);
+        dir.throttle->stop();
+        checkFinished();
+        return;
+    }
+
+    dir.readNotifier->setEnabled(!dir.eof && dir.inPipe < m_pipeSize && !dir.throttle->isActive());
+    dir.writeNotifier->setEnabled(dir.inPipe > 0);
+}
+
+void SpliceTunnel::fail()
+{
+    qDebug() << "Tunnel closed by peer";
+
+    m_upload.done = m_download.done = true;
+    checkFinished();
+}
+
+void SpliceTunnel::checkFinished()
+{
+    if(m_finished || !m_upload.done || !m_download.done)
+        return;
+
+    m_finished = true;
+
+    Direction *dirs[] = {&m_upload, &m_download};
+    for(int i = 0; i < 2; i++)
+    {
+        if(dirs[i]->readNotifier)
+            dirs[i]->readNotifier->setEnabled(false);
+        if(dirs[i]->writeNotifier)
+            dirs[i]->writeNotifier->setEnabled(false);
+        if(dirs[i]->throttle)
+            dirs[i]->throttle->stop();
+    }
+
+    emit finished();
+}
+
+qint64 SpliceTunnel::bytesUploaded() const
+{
+    return m_upload.total;
+}
+
+qint64 SpliceTunnel::bytesDownloaded() const
+{
+    return m_download.total;
+}
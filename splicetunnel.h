@@ -0,0 +1,82 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPLICETUNNEL_H
+#define SPLICETUNNEL_H
+
+#include <QObject>
+#include <QSocketNotifier>
+#include <QTimer>
+
+/**
+ * Linux CONNECT tunnel that moves the data between the two sockets with
+ * splice(2) through a pipe on each direction, so it never reaches user
+ * space. Each direction is shut down on its own when its source reaches
+ * the end of the stream. The data still goes through the WAN limit, so a
+ * tunnel spliced before a limit was set is paced once it is.
+ */
+class SpliceTunnel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SpliceTunnel(int client, int remote, QObject *parent = 0);
+    ~SpliceTunnel();
+
+    bool start();
+    qint64 bytesUploaded() const;
+    qint64 bytesDownloaded() const;
+
+signals:
+    void finished();
+
+private slots:
+    void pumpUpload();
+    void pumpDownload();
+
+private:
+    struct Direction
+    {
+        int from;
+        int to;
+        int pipe[2];
+        qint64 inPipe;
+        qint64 total;
+        bool eof;
+        bool done;
+        QSocketNotifier *readNotifier;
+        QSocketNotifier *writeNotifier;
+        QTimer *throttle;
+    };
+
+    void initDirection(Direction &dir, int from, int to);
+    bool setupDirection(Direction &dir, const char *slot);
+    void pump(Direction &dir);
+    void fail();
+    void checkFinished();
+
+    Direction m_upload;
+    Direction m_download;
+    int m_client;
+    int m_remote;
+    int m_pipeSize;
+    bool m_finished;
+};
+
+#endif // SPLICETUNNEL_H
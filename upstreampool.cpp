@@ -0,0 +1,196 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "upstreampool.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QSettings>
+#include <QThread>
+
+UpstreamPool::UpstreamPool(QObject *parent) :
+    QObject(parent)
+{
+    QSettings settings;
+    m_maxIdle = settings.value("upstreamMaxIdle", 4).toInt();
+    m_idleTimeout = settings.value("upstreamIdleTimeout", 30).toInt() * 1000;
+
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(expireConnections()));
+    m_timer.start(5000);
+}
+
+UpstreamPool::~UpstreamPool()
+{
+    foreach(const QList<IdleConnection> &list, m_idle)
+    {
+        foreach(const IdleConnection &idle, list)
+            destroy(idle.socket);
+    }
+}
+
+/**
+ * @brief UpstreamPool::instance
+ * The first call must be done from the main thread, it is done by the
+ * ProxyServer constructor
+ * @return the shared pool
+ */
+UpstreamPool *UpstreamPool::instance()
+{
+    static UpstreamPool *pool = new UpstreamPool(QCoreApplication::instance());
+    return pool;
+}
+
+/**
+ * @brief UpstreamPool::acquire
+ * Take an idle connection to host, the socket is moved to the calling
+ * thread and has no parent
+ * @param host remote host in host:port format
+ * @return a connected socket or NULL if there is none available
+ */
+QTcpSocket *UpstreamPool::acquire(const QString &host)
+{
+    forever
+    {
+        IdleConnection idle;
+
+        {
+            QMutexLocker locker(&m_mutex);
+            QHash<QString, QList<IdleConnection> >::iterator it = m_idle.find(host);
+
+            if(it == m_idle.end() || it->isEmpty())
+                return NULL;
+
+            // the most recently used connection is the less likely to be closed
+            idle = it->takeLast();
+            if(it->isEmpty())
+                m_idle.erase(it);
+        }
+
+        idle.socket->moveToThread(QThread::currentThread());
+
+        if(QDateTime::currentMSecsSinceEpoch() - idle.since < m_idleTimeout && isHealthy(idle.socket))
+            return idle.socket;
+
+        delete idle.socket;
+    }
+}
+
+/**
+ * @brief UpstreamPool::release
+ * Park a connection after a complete response, must be called from the
+ * thread of the socket and outside of its signal handlers
+ * @param host remote host in host:port format
+ * @param socket connection to park, the pool takes ownership
+ */
+void UpstreamPool::release(const QString &host, QTcpSocket *socket)
+{
+    socket->disconnect();
+    socket->setParent(NULL);
+
+    if(!isHealthy(socket) || socket->bytesToWrite() > 0)
+    {
+        delete socket;
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    QList<IdleConnection> &list = m_idle[host];
+
+    if(list.size() >= m_maxIdle)
+    {
+        locker.unlock();
+        delete socket;
+        return;
+    }
+
+    // no event processing while parked, the next owner pulls it to its thread
+    socket->moveToThread(NULL);
+
+    IdleConnection idle;
+    idle.socket = socket;
+    idle.since = QDateTime::currentMSecsSinceEpoch();
+    list.append(idle);
+}
+
+int UpstreamPool::idleCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    int count = 0;
+
+    foreach(const QList<IdleConnection> &list, m_idle)
+        count += list.size();
+
+    return count;
+}
+
+/**
+ * @brief UpstreamPool::expireConnections
+ * close the connections that were idle for too long
+ */
+void UpstreamPool::expireConnections()
+{
+    QList<QTcpSocket *> expired;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    {
+        QMutexLocker locker(&m_mutex);
+        QHash<QString, QList<IdleConnection> >::iterator it = m_idle.begin();
+
+        while(it != m_idle.end())
+        {
+            // the oldest connections are at the front of the list
+            while(!it->isEmpty() && now - it->first().since >= m_idleTimeout)
+                expired << it->takeFirst().socket;
+
+            if(it->isEmpty())
+                it = m_idle.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    foreach(QTcpSocket *socket, expired)
+        destroy(socket);
+}
+
+/**
+ * @brief UpstreamPool::isHealthy
+ * check, without blocking, that the remote server didn't close the
+ * connection nor sent unexpected data while it was idle
+ */
+bool UpstreamPool::isHealthy(QTcpSocket *socket)
+{
+    if(socket->state() != QAbstractSocket::ConnectedState || socket->bytesAvailable() > 0)
+        return false;
+
+    // a closed connection is reported as readable, the read finds the EOF
+    if(socket->waitForReadyRead(0))
+        return false;
+
+    return socket->state() == QAbstractSocket::ConnectedState;
+}
+
+void UpstreamPool::destroy(QTcpSocket *socket)
+{
+    socket->moveToThread(QThread::currentThread());
+    socket->abort();
+    delete socket;
+}
@@ -0,0 +1,70 @@
+/**
+ * QPSNProxy is an open source software for downloading PSN packages
+ * on a PC, then transfer them to a game console via a HTTP proxy.
+ *
+ *  Copyright (C) 2014 codestation
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPSTREAMPOOL_H
+#define UPSTREAMPOOL_H
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+
+/**
+ * Idle keep-alive connections to remote servers, indexed by host:port.
+ * The pool is shared by all the proxy worker threads: an idle socket has
+ * no thread affinity while it is parked and it is pulled into the thread
+ * of the connection that acquires it.
+ */
+class UpstreamPool : public QObject
+{
+    Q_OBJECT
+public:
+    static UpstreamPool *instance();
+    ~UpstreamPool();
+
+    QTcpSocket *acquire(const QString &host);
+    void release(const QString &host, QTcpSocket *socket);
+    int idleCount() const;
+
+private slots:
+    void expireConnections();
+
+private:
+    explicit UpstreamPool(QObject *parent = 0);
+
+    struct IdleConnection
+    {
+        QTcpSocket *socket;
+        qint64 since;
+    };
+
+    static bool isHealthy(QTcpSocket *socket);
+    static void destroy(QTcpSocket *socket);
+
+    mutable QMutex m_mutex;
+    QHash<QString, QList<IdleConnection> > m_idle;
+    QTimer m_timer;
+    int m_maxIdle;
+    qint64 m_idleTimeout;
+};
+
+#endif // UPSTREAMPOOL_H
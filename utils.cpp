@@ -19,6 +19,7 @@
  */
 
 #include "utils.h"
+#include <QLocale>
 #include <QStringListIterator>
 
 QString readable_size(qint64 size, bool use_gib)
@@ -40,3 +41,9 @@ QString readable_size(qint64 size, bool use_gib)
     }
     return QString().setNum(size_f,'f',2) + " " + unit;
 }
+
+QString http_date(const QDateTime &date)
+{
+    // RFC 7231 IMF-fixdate, day and month names are always in english
+    return QLocale::c().toString(date.toUTC(), "ddd, dd MMM yyyy hh:mm:ss 'GMT'");
+}
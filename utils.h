@@ -21,8 +21,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <QDateTime>
 #include <QString>
 
 QString readable_size(qint64 size, bool use_gib);
+QString http_date(const QDateTime &date);
 
 #endif // UTILS_H